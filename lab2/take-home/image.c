@@ -0,0 +1,469 @@
+/*
+  Volume images.
+
+  One file holds a whole volume, laid out so that everything sized by the
+  volume is used in place through a shared mapping and nothing is read in
+  at mount:
+
+	page 0		superblock
+	...		inode bitmap, every level (bitmap_storage_words)
+	...		data block bitmap, every level
+	...		inline data, NUM_INODES * inline_size bytes
+	...		data region, NUM_DATA_BLOCKS * DATA_BLOCK_SIZE bytes
+	meta_off	files, sizes, attributes and block maps, written by image_sync
+
+  Regions start on IMAGE_ALIGN boundaries. Only the last region, whose size
+  follows the number of extents and files rather than the volume, is
+  parsed at mount. Fields are in host byte order.
+
+  image_sync is a checkpoint: it writes a new meta region beside the
+  current one and only then repoints the superblock, so a crash leaves one
+  of the two whole. File sizes live in the inode table and are only
+  written out in the meta region. While mounted the superblock is marked
+  dirty; mounting a dirty image trusts neither mapped bitmap, but rebuilds
+  them from the checkpoint and replays the journal (journal.c) onto it.
+*/
+
+#include "params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IMAGE_MAGIC "MYFSIMG"
+#define IMAGE_VERSION 5
+#define IMAGE_ALIGN 4096
+
+struct image_super {
+	char magic[8];
+	uint32_t version;
+	int32_t num_inodes;
+	int32_t num_data_blocks;
+	int32_t data_block_size;
+	int32_t inline_size;
+	uint64_t inode_bitmap_off;
+	uint64_t block_bitmap_off;
+	uint64_t inline_off;
+	uint64_t data_off;
+	uint64_t meta_off;
+	uint64_t meta_len;
+	uint64_t meta_hash;	/* FNV-1a of the meta region, to catch a torn sync */
+	uint64_t seq;		/* checkpoints so far; names the journal that follows */
+	uint32_t clean;		/* unmounted with a final image_sync */
+};
+
+/* Growable buffer the meta region is built in */
+struct meta_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+	int failed;		/* an append ran out of memory */
+};
+
+static uint64_t align_up(uint64_t n)
+{
+	return (n + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1);
+}
+
+static uint64_t meta_hash(const char *data, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (len--) {
+		h ^= (unsigned char)*data++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/* Region offsets for the volume geometry in s; returns the mapped size */
+static uint64_t image_layout(const struct myfs_state *s, struct image_super *sb)
+{
+	uint64_t off = IMAGE_ALIGN;
+
+	sb->inode_bitmap_off = off;
+	off = align_up(off + bitmap_storage_words(s->NUM_INODES) * sizeof(uint64_t));
+	sb->block_bitmap_off = off;
+	off = align_up(off + bitmap_storage_words(s->NUM_DATA_BLOCKS) * sizeof(uint64_t));
+	sb->inline_off = off;
+	off = align_up(off + (uint64_t)s->NUM_INODES * (uint64_t)s->inline_size);
+	sb->data_off = off;
+	off += (uint64_t)s->NUM_DATA_BLOCKS * (uint64_t)s->DATA_BLOCK_SIZE;
+	sb->meta_off = off;
+	return off;
+}
+
+static void meta_put(struct meta_buf *m, const void *data, size_t len)
+{
+	size_t cap;
+	char *p;
+
+	if (m->failed || len == 0)
+		return;
+	if (m->len + len > m->cap) {
+		cap = m->cap ? m->cap : 4096;
+		while (cap < m->len + len)
+			cap *= 2;
+		p = (char *)realloc(m->data, cap);
+		if (!p) {
+			m->failed = 1;
+			return;
+		}
+		m->data = p;
+		m->cap = cap;
+	}
+	memcpy(m->data + m->len, data, len);
+	m->len += len;
+}
+
+static void meta_put_time(struct meta_buf *m, const struct timespec *ts)
+{
+	int64_t v[2] = { (int64_t)ts->tv_sec, (int64_t)ts->tv_nsec };
+
+	meta_put(m, v, sizeof(v));
+}
+
+/* Pull len bytes from the meta region at *pos; -1 past its end */
+static int meta_get(const char *meta, size_t meta_len, size_t *pos, void *out, size_t len)
+{
+	if (len > meta_len - *pos)
+		return -1;
+	memcpy(out, meta + *pos, len);
+	*pos += len;
+	return 0;
+}
+
+static int meta_get_time(const char *meta, size_t meta_len, size_t *pos, struct timespec *ts)
+{
+	int64_t v[2];
+
+	if (meta_get(meta, meta_len, pos, v, sizeof(v)) != 0 || v[1] < 0 || v[1] >= 1000000000)
+		return -1;
+	ts->tv_sec = (time_t)v[0];
+	ts->tv_nsec = (long)v[1];
+	return 0;
+}
+
+/*
+ * Meta region: int32 count, then per file:
+ *	int32 inode, int64 size, int32 length, the path's bytes,
+ *	uint32 mode, 3 * (int64 sec, int64 nsec) atime, mtime, ctime,
+ *	int32 num_extents, num_extents * struct extent
+ *
+ * A dirty image (rebuild) also takes the bitmaps from here; a clean one
+ * already has them in place.
+ */
+static int image_parse_meta(struct myfs_state *s, const char *meta, size_t len, int rebuild)
+{
+	char path[PATH_MAX];
+	struct inode *ino;
+	size_t pos = 0;
+	int32_t count, i, n, inode, plen;
+	uint32_t mode;
+	int64_t size;
+	int j, b, nblocks, res = -1;
+	char *seen;
+
+	if (meta_get(meta, len, &pos, &count, sizeof(count)) != 0)
+		return -1;
+	/* each inode at most once */
+	seen = (char *)calloc((size_t)s->NUM_INODES, 1);
+	if (!seen)
+		return -1;
+	for (i = 0; i < count; i++) {
+		if (meta_get(meta, len, &pos, &inode, sizeof(inode)) != 0 ||
+		    meta_get(meta, len, &pos, &size, sizeof(size)) != 0 ||
+		    meta_get(meta, len, &pos, &plen, sizeof(plen)) != 0)
+			goto out;
+		if (inode < 0 || inode >= s->NUM_INODES || seen[inode]++ || size < 0 ||
+		    plen <= 0 || plen >= PATH_MAX ||
+		    meta_get(meta, len, &pos, path, (size_t)plen) != 0 ||
+		    meta_get(meta, len, &pos, &mode, sizeof(mode)) != 0)
+			goto out;
+		path[plen] = '\0';
+		ino = &s->inodes[inode];
+		if (meta_get_time(meta, len, &pos, &ino->atime) != 0 ||
+		    meta_get_time(meta, len, &pos, &ino->mtime) != 0 ||
+		    meta_get_time(meta, len, &pos, &ino->ctime) != 0 ||
+		    meta_get(meta, len, &pos, &n, sizeof(n)) != 0)
+			goto out;
+		ino->mode = (mode_t)mode;
+		if (n < 0 || (size_t)n > (len - pos) / sizeof(struct extent) ||
+		    inode_reserve_extents(ino, n) != 0)
+			goto out;
+		meta_get(meta, len, &pos, ino->extents, (size_t)n * sizeof(struct extent));
+		ino->num_extents = n;
+		nblocks = 0;
+		for (j = 0; j < n; j++) {
+			const struct extent *e = &ino->extents[j];
+
+			/* sorted and disjoint; gaps between extents are holes */
+			if ((j > 0 && e->logical < e[-1].logical + e[-1].length) || e->logical < 0 ||
+			    e->length <= 0 || e->logical > INT_MAX - e->length || e->start < 0 ||
+			    e->start > s->NUM_DATA_BLOCKS - e->length)
+				goto out;
+			nblocks += e->length;
+			for (b = e->start; rebuild && b < e->start + e->length; b++)
+				bitmap_set(&s->data_block_bitmap, b);
+		}
+		ino->num_blocks = nblocks;
+		ino->size = (off_t)size;
+		if (rebuild)
+			bitmap_set(&s->inode_bitmap, inode);
+		path_to_inode_add(s, path, inode);
+	}
+	res = s->path_count == count ? 0 : -1;
+out:
+	free(seen);
+	return res;
+}
+
+int image_open(struct myfs_state *s, const char *image)
+{
+	struct image_super want, *sb;
+	struct stat st;
+	char journal[PATH_MAX];
+	uint64_t map_size;
+	char *meta = NULL;
+	int fresh, rebuild, replayed = 0;
+
+	memset(&want, 0, sizeof(want));
+	map_size = image_layout(s, &want);
+	if (map_size > SIZE_MAX) {
+		fprintf(stderr, "image %s: volume too large to map\n", image);
+		return -1;
+	}
+	s->image_path = strdup(image);
+	if (!s->image_path)
+		return -1;
+	snprintf(journal, sizeof(journal), "%s.journal", s->image_path);
+
+	s->image_fd = open(image, O_RDWR | O_CREAT, 0644);
+	if (s->image_fd < 0 || fstat(s->image_fd, &st) != 0) {
+		perror(image);
+		return -1;
+	}
+	fresh = st.st_size == 0;
+	if (fresh && ftruncate(s->image_fd, (off_t)map_size) != 0) {
+		perror(image);
+		return -1;
+	}
+	if (!fresh && (uint64_t)st.st_size < map_size) {
+		fprintf(stderr, "image %s: too small for this volume\n", image);
+		return -1;
+	}
+	s->image_map = (char *)mmap(NULL, (size_t)map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->image_fd, 0);
+	if (s->image_map == MAP_FAILED) {
+		s->image_map = NULL;
+		perror(image);
+		return -1;
+	}
+	s->image_map_size = (size_t)map_size;
+	sb = (struct image_super *)s->image_map;
+
+	if (fresh) {
+		memcpy(want.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+		want.version = IMAGE_VERSION;
+		want.num_inodes = s->NUM_INODES;
+		want.num_data_blocks = s->NUM_DATA_BLOCKS;
+		want.data_block_size = s->DATA_BLOCK_SIZE;
+		want.inline_size = s->inline_size;
+		want.clean = 1;
+		*sb = want;
+	} else if (memcmp(sb->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+		   sb->version != IMAGE_VERSION) {
+		fprintf(stderr, "image %s: not a myfs image\n", image);
+		return -1;
+	} else if (sb->num_inodes != s->NUM_INODES || sb->num_data_blocks != s->NUM_DATA_BLOCKS ||
+		   sb->data_block_size != s->DATA_BLOCK_SIZE || sb->inline_size != s->inline_size ||
+		   sb->meta_off < want.meta_off) {
+		fprintf(stderr, "image %s: made for %d inodes, %d blocks of %d bytes, %d inline\n",
+			image, sb->num_inodes, sb->num_data_blocks, sb->data_block_size, sb->inline_size);
+		return -1;
+	}
+
+	/* a dirty image's bitmaps are whatever reached the disk */
+	rebuild = !fresh && !sb->clean;
+	bitmap_init_at(&s->inode_bitmap, s->NUM_INODES,
+		       (uint64_t *)(s->image_map + sb->inode_bitmap_off), fresh || rebuild);
+	bitmap_init_at(&s->data_block_bitmap, s->NUM_DATA_BLOCKS,
+		       (uint64_t *)(s->image_map + sb->block_bitmap_off), fresh || rebuild);
+	s->inline_data = s->image_map + sb->inline_off;
+	s->block_arena = s->image_map + sb->data_off;
+	s->block_arena_size = (size_t)s->NUM_DATA_BLOCKS * (size_t)s->DATA_BLOCK_SIZE;
+	s->block_arena_fd = s->image_fd;
+	s->block_arena_off = (off_t)sb->data_off;
+
+	if (!fresh && sb->meta_len > 0) {
+		meta = (char *)malloc((size_t)sb->meta_len);
+		if (!meta || pread(s->image_fd, meta, (size_t)sb->meta_len, (off_t)sb->meta_off) != (ssize_t)sb->meta_len ||
+		    meta_hash(meta, (size_t)sb->meta_len) != sb->meta_hash ||
+		    image_parse_meta(s, meta, (size_t)sb->meta_len, rebuild) != 0) {
+			fprintf(stderr, "image %s: block maps and paths are damaged\n", image);
+			free(meta);
+			return -1;
+		}
+		free(meta);
+	}
+	/* the journal frees shared blocks by their counts; the replayed
+	 * clones and copies change them, so they are counted again after */
+	if (myfs_blocks_count_refs(s) != 0) {
+		fprintf(stderr, "image %s: cannot count shared blocks\n", image);
+		return -1;
+	}
+	if (rebuild) {
+		replayed = journal_replay(s, journal, sb->seq);
+		if (replayed < 0 || myfs_blocks_count_refs(s) != 0) {
+			fprintf(stderr, "image %s: journal %s is damaged\n", image, journal);
+			return -1;
+		}
+		fprintf(stderr, "image %s: not unmounted cleanly, replayed %d journal records\n",
+			image, replayed);
+	}
+
+	/* checkpoint what was recovered, then stay dirty until unmount */
+	if (rebuild && image_sync(s, 0) != 0) {
+		fprintf(stderr, "image %s: cannot checkpoint the recovered volume\n", image);
+		return -1;
+	}
+	s->journal.seq = sb->seq;
+	sb->clean = 0;
+	if (msync(s->image_map, IMAGE_ALIGN, MS_SYNC) != 0) {
+		perror(image);
+		return -1;
+	}
+	return 0;
+}
+
+int image_sync(struct myfs_state *s, int unmount)
+{
+	struct image_super *sb = (struct image_super *)s->image_map;
+	struct image_super want;
+	struct meta_buf m = { NULL, 0, 0, 0 };
+	const struct inode *ino;
+	char journal[PATH_MAX], path[PATH_MAX];
+	uint64_t base, at;
+	int32_t count, v;
+	uint32_t mode;
+	int64_t size;
+	int i, res = 0;
+
+	if (!s->image_map)
+		return 0;
+
+	/* buffered appends get the blocks the saved maps will show */
+	for (i = 0; i < s->path_count; i++) {
+		res = inode_commit_pending(s, &s->inodes[s->path_to_inode[i].inode]);
+		if (res != 0)
+			return res;
+	}
+
+	count = s->path_count;
+	meta_put(&m, &count, sizeof(count));
+	for (i = 0; i < s->path_count; i++) {
+		v = s->path_to_inode[i].inode;
+		ino = &s->inodes[v];
+		meta_put(&m, &v, sizeof(v));
+		size = (int64_t)ino->size;
+		meta_put(&m, &size, sizeof(size));
+		/* a directory rename can leave a path too long to load */
+		v = dentry_path(s->path_to_inode[i].dentry, path, sizeof(path));
+		if (v < 0) {
+			free(m.data);
+			return -ENAMETOOLONG;
+		}
+		meta_put(&m, &v, sizeof(v));
+		meta_put(&m, path, (size_t)v);
+		mode = (uint32_t)ino->mode;
+		meta_put(&m, &mode, sizeof(mode));
+		meta_put_time(&m, &ino->atime);
+		meta_put_time(&m, &ino->mtime);
+		meta_put_time(&m, &ino->ctime);
+		v = ino->num_extents;
+		meta_put(&m, &v, sizeof(v));
+		meta_put(&m, ino->extents, (size_t)ino->num_extents * sizeof(struct extent));
+	}
+	if (m.failed) {
+		free(m.data);
+		return -ENOMEM;
+	}
+
+	/* the new meta region goes where it can't overlap the current one */
+	base = image_layout(s, &want);
+	if (sb->meta_len == 0 || base + m.len <= sb->meta_off)
+		at = base;
+	else
+		at = align_up(sb->meta_off + sb->meta_len);
+	if (pwrite(s->image_fd, m.data, m.len, (off_t)at) != (ssize_t)m.len ||
+	    fdatasync(s->image_fd) != 0 ||
+	    msync(s->image_map, s->image_map_size, MS_SYNC) != 0)
+		res = -errno;
+
+	/* then the superblock that points at it, in one page */
+	if (res == 0) {
+		sb->meta_off = at;
+		sb->meta_len = m.len;
+		sb->meta_hash = meta_hash(m.data, m.len);
+		sb->seq++;
+		sb->clean = unmount != 0;
+		if (msync(s->image_map, IMAGE_ALIGN, MS_SYNC) != 0 ||
+		    ftruncate(s->image_fd, (off_t)(at + m.len)) != 0)
+			res = -errno;
+	}
+	free(m.data);
+	if (res == 0) {
+		snprintf(journal, sizeof(journal), "%s.journal", s->image_path);
+		res = journal_reset(s, journal, sb->seq);
+	}
+	return res;
+}
+
+/* msync the pages of the mapping holding [p, p + len) */
+static int sync_range(const char *p, size_t len)
+{
+	const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t lo = (uintptr_t)p & ~(page - 1);
+
+	if (msync((void *)lo, (uintptr_t)p + len - lo, MS_SYNC) != 0)
+		return -errno;
+	return 0;
+}
+
+int image_sync_file(struct myfs_state *s, const struct inode *ino)
+{
+	const size_t bs = (size_t)s->DATA_BLOCK_SIZE;
+	const struct extent *e;
+	int i, res = 0;
+
+	if (!s->image_map)
+		return 0;
+	if (s->inline_size > 0)
+		res = sync_range(s->inline_data + (size_t)ino->index * (size_t)s->inline_size,
+				 (size_t)s->inline_size);
+	/* an extent's blocks are contiguous in the data region */
+	for (i = 0; i < ino->num_extents && res == 0; i++) {
+		e = &ino->extents[i];
+		res = sync_range(s->data_blocks[e->start].data, (size_t)e->length * bs);
+	}
+	return res;
+}
+
+void image_close(struct myfs_state *s)
+{
+	if (s->image_map)
+		munmap(s->image_map, s->image_map_size);
+	if (s->image_fd >= 0)
+		close(s->image_fd);
+	s->image_map = NULL;
+	s->image_fd = -1;
+	s->block_arena = NULL;
+	s->block_arena_fd = -1;
+	free(s->image_path);
+	s->image_path = NULL;
+}
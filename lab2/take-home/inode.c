@@ -0,0 +1,588 @@
+/*
+  Inode block maps.
+
+  An inode maps file blocks to data blocks with extents: runs of physically
+  contiguous data blocks, sorted by the file block they start at. The first
+  INODE_INLINE_EXTENTS live in the inode itself; past that the array moves
+  to the heap and grows on demand, so an inode costs memory in proportion
+  to how fragmented the file is rather than to the size of the volume.
+  File blocks no extent covers are holes: they read as zeros and take no
+  data block.
+
+  With an inline area (myfs_state.inline_size > 0) a file that maps no
+  blocks and is no longer than the area keeps its bytes there instead, so
+  tiny files take no data block at all. Whether a file is inline follows
+  from its size and block count alone; the area of an inode holds zeros
+  past the file's size, so a block-less file that shrinks into it (or a
+  hole that was never written) reads back as zeros. A write or truncate
+  that takes an inline file past the area moves its bytes to a block.
+
+  With delayed allocation (myfs_state.delalloc_blocks > 0) appends past
+  the last block gather in a per-inode buffer and take data blocks, as one
+  run, only when it fills or the file is read, synced or closed, so files
+  appended to in turn still get long extents. A block is held free for
+  every block the buffer reaches into, so a full volume fails the append
+  rather than the commit.
+*/
+
+#include "params.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+_Static_assert(offsetof(struct inode, lock) == CACHE_LINE,
+	       "an inode's size and block map must fit its first cache line");
+
+/* What holes read as; longer holes take several iovecs */
+static const char hole_zeros[1 << 16];
+
+char *inode_inline_data(const struct myfs_state *s, const struct inode *ino)
+{
+	if (s->inline_size == 0 || ino->num_blocks > 0 || ino->size > (off_t)s->inline_size)
+		return NULL;
+	return s->inline_data + (size_t)ino->index * (size_t)s->inline_size;
+}
+
+int inode_promote(struct myfs_state *s, struct inode *ino)
+{
+	char *data = inode_inline_data(s, ino), *block;
+	int res;
+
+	if (!data || ino->size == 0)
+		return 0;
+	res = myfs_blocks_alloc(s, ino, 0, 1);
+	if (res != 0)
+		return res;
+	block = s->data_blocks[inode_block_at(ino, 0)].data;
+	memcpy(block, data, (size_t)ino->size);
+	memset(block + ino->size, 0, (size_t)s->DATA_BLOCK_SIZE - (size_t)ino->size);
+	memset(data, 0, (size_t)ino->size);
+	return 0;
+}
+
+int inode_extent_after(const struct inode *ino, int lblk)
+{
+	int lo = 0, hi = ino->num_extents, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ino->extents[mid].logical + ino->extents[mid].length <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Index of the extent containing file block lblk, or -1 */
+int inode_extent_index(const struct inode *ino, int lblk)
+{
+	int lo = 0, hi = ino->num_extents - 1, mid;
+	const struct extent *e;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &ino->extents[mid];
+		if (lblk < e->logical)
+			hi = mid - 1;
+		else if (lblk >= e->logical + e->length)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+	return -1;
+}
+
+int inode_block_at(const struct inode *ino, int lblk)
+{
+	int i = inode_extent_index(ino, lblk);
+
+	if (i < 0)
+		return -1;
+	return ino->extents[i].start + (lblk - ino->extents[i].logical);
+}
+
+int inode_reserve_extents(struct inode *ino, int n)
+{
+	struct extent *e;
+	int max;
+
+	if (n <= ino->max_extents)
+		return 0;
+	max = ino->max_extents > INODE_INLINE_EXTENTS ? ino->max_extents : INODE_INLINE_EXTENTS;
+	while (max < n)
+		max *= 2;
+	if (ino->extents == ino->inline_extents) {
+		e = (struct extent *)malloc((size_t)max * sizeof(struct extent));
+		if (e)
+			memcpy(e, ino->inline_extents, (size_t)ino->num_extents * sizeof(struct extent));
+	} else {
+		e = (struct extent *)realloc(ino->extents, (size_t)max * sizeof(struct extent));
+	}
+	if (!e)
+		return -1;
+	ino->extents = e;
+	ino->max_extents = max;
+	return 0;
+}
+
+int inode_append_block(struct inode *ino, int block)
+{
+	struct extent *e;
+
+	if (ino->num_extents > 0) {
+		e = &ino->extents[ino->num_extents - 1];
+		if (e->start + e->length == block) {
+			e->length++;
+			ino->num_blocks++;
+			return 0;
+		}
+	}
+	if (inode_reserve_extents(ino, ino->num_extents + 1) != 0)
+		return -1;
+	e = &ino->extents[ino->num_extents];
+	e->logical = inode_end_block(ino);
+	ino->num_extents++;
+	e->start = block;
+	e->length = 1;
+	ino->num_blocks++;
+	return 0;
+}
+
+int inode_end_block(const struct inode *ino)
+{
+	const struct extent *e;
+
+	if (ino->num_extents == 0)
+		return 0;
+	e = &ino->extents[ino->num_extents - 1];
+	return e->logical + e->length;
+}
+
+int inode_map_extent(struct inode *ino, int lblk, int start, int n)
+{
+	struct extent *e;
+	int i = inode_extent_after(ino, lblk);
+
+	/* extend the extent before, then maybe join it with the one after */
+	if (i > 0) {
+		e = &ino->extents[i - 1];
+		if (e->logical + e->length == lblk && e->start + e->length == start) {
+			e->length += n;
+			ino->num_blocks += n;
+			if (i < ino->num_extents && e[1].logical == lblk + n && e[1].start == start + n) {
+				e->length += e[1].length;
+				memmove(e + 1, e + 2, (size_t)(ino->num_extents - i - 1) * sizeof(*e));
+				ino->num_extents--;
+			}
+			return 0;
+		}
+	}
+	if (i < ino->num_extents) {
+		e = &ino->extents[i];
+		if (e->logical == lblk + n && e->start == start + n) {
+			e->logical = lblk;
+			e->start = start;
+			e->length += n;
+			ino->num_blocks += n;
+			return 0;
+		}
+	}
+	if (inode_reserve_extents(ino, ino->num_extents + 1) != 0)
+		return -1;
+	e = &ino->extents[i];
+	memmove(e + 1, e, (size_t)(ino->num_extents - i) * sizeof(*e));
+	e->logical = lblk;
+	e->start = start;
+	e->length = n;
+	ino->num_extents++;
+	ino->num_blocks += n;
+	return 0;
+}
+
+int inode_map_block(struct inode *ino, int lblk, int block)
+{
+	return inode_map_extent(ino, lblk, block, 1);
+}
+
+int inode_remap_block(struct inode *ino, int lblk, int block)
+{
+	struct extent *e;
+	int i = inode_extent_index(ino, lblk), off;
+
+	/* room for a split and a new extent, so nothing fails halfway */
+	if (i < 0 || inode_reserve_extents(ino, ino->num_extents + 2) != 0)
+		return -1;
+	e = &ino->extents[i];
+	off = lblk - e->logical;
+	if (e->length == 1) {
+		memmove(e, e + 1, (size_t)(ino->num_extents - i - 1) * sizeof(*e));
+		ino->num_extents--;
+	} else if (off == 0) {
+		e->logical++;
+		e->start++;
+		e->length--;
+	} else if (off == e->length - 1) {
+		e->length--;
+	} else {
+		memmove(e + 2, e + 1, (size_t)(ino->num_extents - i - 1) * sizeof(*e));
+		e[1].logical = lblk + 1;
+		e[1].start = e->start + off + 1;
+		e[1].length = e->length - off - 1;
+		e->length = off;
+		ino->num_extents++;
+	}
+	ino->num_blocks--;
+	return inode_map_block(ino, lblk, block);
+}
+
+int inode_mapped_blocks(const struct inode *ino, int lblk, int n)
+{
+	const struct extent *e;
+	int i, lo, hi, mapped = 0;
+
+	for (i = inode_extent_after(ino, lblk); i < ino->num_extents; i++) {
+		e = &ino->extents[i];
+		if (e->logical >= lblk + n)
+			break;
+		lo = e->logical > lblk ? e->logical : lblk;
+		hi = e->logical + e->length < lblk + n ? e->logical + e->length : lblk + n;
+		mapped += hi - lo;
+	}
+	return mapped;
+}
+
+void inode_unmap_from(struct inode *ino, int lblk)
+{
+	struct extent *e;
+
+	if (lblk <= 0) {
+		inode_clear_blocks(ino);
+		return;
+	}
+	while (ino->num_extents > 0) {
+		e = &ino->extents[ino->num_extents - 1];
+		if (e->logical + e->length <= lblk)
+			break;
+		if (e->logical < lblk) {
+			ino->num_blocks -= e->logical + e->length - lblk;
+			e->length = lblk - e->logical;
+			break;
+		}
+		ino->num_blocks -= e->length;
+		ino->num_extents--;
+	}
+}
+
+void inode_touch(struct inode *ino, int all)
+{
+	clock_gettime(CLOCK_REALTIME, &ino->mtime);
+	ino->ctime = ino->mtime;
+	if (all)
+		ino->atime = ino->mtime;
+}
+
+void inode_clear_blocks(struct inode *ino)
+{
+	if (ino->extents != ino->inline_extents)
+		free(ino->extents);
+	ino->extents = ino->inline_extents;
+	ino->num_extents = 0;
+	ino->max_extents = INODE_INLINE_EXTENTS;
+	ino->num_blocks = 0;
+}
+
+size_t inode_read(const struct myfs_state *s, const struct inode *ino, off_t file_size,
+		  char *buf, size_t size, off_t offset)
+{
+	struct iovec iov[64];
+	size_t done = 0;
+	int i, n;
+
+	/* one memcpy per extent (an extent's blocks are adjacent in the block
+	 * arena); holes are zero-filled in place */
+	do {
+		n = inode_iovec(s, ino, file_size, offset + (off_t)done, size - done, iov, 64);
+		for (i = 0; i < n; i++) {
+			if (iov[i].iov_base == hole_zeros)
+				memset(buf + done, 0, iov[i].iov_len);
+			else
+				memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+			done += iov[i].iov_len;
+		}
+	} while (n == 64);
+	return done;
+}
+
+int inode_iovec(const struct myfs_state *s, const struct inode *ino, off_t file_size,
+		off_t offset, size_t size, struct iovec *iov, int max_iov)
+{
+	const off_t bs = (off_t)s->DATA_BLOCK_SIZE;
+	const struct extent *e;
+	off_t pos = offset, end, run_end;
+	char *data;
+	int i, n = 0;
+
+	if (offset >= file_size)
+		return 0;
+	end = file_size - offset < (off_t)size ? file_size : offset + (off_t)size;
+
+	data = inode_inline_data(s, ino);
+	if (data && max_iov > 0) {
+		iov[0].iov_base = data + offset;
+		iov[0].iov_len = (size_t)(end - offset);
+		return 1;
+	}
+
+	i = inode_extent_after(ino, (int)(offset / bs));
+	while (pos < end && n < max_iov) {
+		e = i < ino->num_extents ? &ino->extents[i] : NULL;
+		if (!e || pos < (off_t)e->logical * bs) {
+			/* a hole, up to the next extent */
+			run_end = e ? (off_t)e->logical * bs : end;
+			if (run_end > end)
+				run_end = end;
+			if (run_end - pos > (off_t)sizeof(hole_zeros))
+				run_end = pos + (off_t)sizeof(hole_zeros);
+			iov[n].iov_base = (void *)hole_zeros;
+		} else {
+			run_end = (off_t)(e->logical + e->length) * bs;
+			if (run_end > end)
+				run_end = end;
+			iov[n].iov_base = s->data_blocks[e->start].data + (pos - (off_t)e->logical * bs);
+			i++;
+		}
+		iov[n].iov_len = (size_t)(run_end - pos);
+		n++;
+		pos = run_end;
+	}
+	return n;
+}
+
+off_t inode_seek(const struct myfs_state *s, const struct inode *ino, off_t file_size,
+		 off_t offset, int whence)
+{
+	const off_t bs = (off_t)s->DATA_BLOCK_SIZE;
+	const struct extent *e;
+	off_t pos;
+	int i;
+
+	if (offset < 0 || offset >= file_size)
+		return -ENXIO;
+	if (inode_inline_data(s, ino))
+		return whence == SEEK_DATA ? offset : file_size;
+	i = inode_extent_after(ino, (int)(offset / bs));
+	e = i < ino->num_extents ? &ino->extents[i] : NULL;
+	if (whence == SEEK_DATA) {
+		if (!e)
+			return -ENXIO;
+		pos = (off_t)e->logical * bs;
+		if (pos <= offset)
+			return offset;
+		return pos < file_size ? pos : -ENXIO;
+	}
+	/* SEEK_HOLE: the end of the run of extents holding offset, if any;
+	 * the end of the file counts as a hole */
+	if (!e || (off_t)e->logical * bs > offset)
+		return offset;
+	while (i + 1 < ino->num_extents &&
+	       ino->extents[i + 1].logical == e->logical + e->length)
+		e = &ino->extents[++i];
+	pos = (off_t)(e->logical + e->length) * bs;
+	return pos < file_size ? pos : file_size;
+}
+
+int inode_write_prepare(struct myfs_state *s, struct inode *ino, size_t size, off_t offset)
+{
+	const off_t bs = (off_t)s->DATA_BLOCK_SIZE;
+	off_t end = offset + (off_t)size;
+	int first, last, head_new, tail_new, res;
+
+	if (size == 0)
+		return 0;
+	if (offset < 0 || end / bs >= INT_MAX)
+		return -EFBIG;
+	res = inode_commit_pending(s, ino);
+	if (res != 0)
+		return res;
+	if (inode_inline_data(s, ino)) {
+		if (end <= (off_t)s->inline_size)
+			return 0;
+		res = inode_promote(s, ino);
+		if (res != 0)
+			return res;
+	}
+	first = (int)(offset / bs);
+	last = (int)((end - 1) / bs);
+
+	/* allocate only what the write touches and nothing maps yet, once
+	 * there is room for that and for unsharing; unsharing goes first, so
+	 * that if another file takes the room meanwhile, the range is left
+	 * with at most copies of its own blocks */
+	res = myfs_blocks_room(s, ino, first, last - first + 1);
+	if (res != 0)
+		return res;
+	head_new = inode_block_at(ino, first) < 0;
+	tail_new = inode_block_at(ino, last) < 0;
+	res = myfs_blocks_unshare(s, ino, first, last - first + 1);
+	if (res != 0)
+		return res;
+	if (inode_mapped_blocks(ino, first, last - first + 1) < last - first + 1) {
+		res = myfs_blocks_alloc(s, ino, first, last - first + 1);
+		if (res != 0)
+			return res;
+	}
+
+	/* new blocks only partly written may hold stale bytes: blocks are not
+	 * zeroed when freed */
+	if (head_new && offset % bs)
+		memset(s->data_blocks[inode_block_at(ino, first)].data, 0, (size_t)(offset % bs));
+	if (tail_new && end % bs)
+		memset(s->data_blocks[inode_block_at(ino, last)].data + end % bs, 0,
+		       (size_t)(bs - end % bs));
+	return 0;
+}
+
+static ssize_t write_in_place(struct myfs_state *s, struct inode *ino, const char *buf,
+			      size_t size, off_t offset)
+{
+	struct iovec iov[64];
+	size_t done = 0;
+	int i, n, res;
+
+	res = inode_write_prepare(s, ino, size, offset);
+	if (res != 0)
+		return res;
+	/* one memcpy per extent; every block of the range is mapped now */
+	do {
+		n = inode_iovec(s, ino, offset + (off_t)size, offset + (off_t)done, size - done, iov, 64);
+		for (i = 0; i < n; i++) {
+			memcpy(iov[i].iov_base, buf + done, iov[i].iov_len);
+			done += iov[i].iov_len;
+		}
+	} while (n == 64);
+	return (ssize_t)size;
+}
+
+/* Blocks the first len bytes of the buffer take */
+static int pending_blocks(const struct myfs_state *s, int len)
+{
+	return (len + s->DATA_BLOCK_SIZE - 1) / s->DATA_BLOCK_SIZE;
+}
+
+/* An append with delayed allocation. The buffer only ever starts at a
+ * block boundary with nothing mapped there, so the bytes up to the end of
+ * a block the file already has (or has reserved) are written in place. */
+static ssize_t write_delayed(struct myfs_state *s, struct inode *ino, const char *buf,
+			     size_t size, off_t offset)
+{
+	const off_t bs = (off_t)s->DATA_BLOCK_SIZE;
+	const int cap = s->delalloc_blocks * s->DATA_BLOCK_SIZE;
+	size_t done = 0, n;
+	off_t pos;
+	ssize_t res;
+	int more;
+
+	while (done < size) {
+		pos = offset + (off_t)done;
+		if (ino->pending_len == 0 && (pos % bs || inode_block_at(ino, (int)(pos / bs)) >= 0)) {
+			n = (size_t)(bs - pos % bs);
+			if (n > size - done)
+				n = size - done;
+			res = write_in_place(s, ino, buf + done, n, pos);
+			if (res < 0)
+				return done ? (ssize_t)done : res;
+			done += n;
+			continue;
+		}
+		if (pos / bs >= INT_MAX)
+			return done ? (ssize_t)done : -EFBIG;
+		if (!ino->pending && !(ino->pending = (char *)malloc((size_t)cap)))
+			return done ? (ssize_t)done : -ENOMEM;
+		if (ino->pending_len == cap) {
+			res = inode_commit_pending(s, ino);
+			if (res != 0)
+				return done ? (ssize_t)done : res;
+		}
+		if (ino->pending_len == 0)
+			ino->pending_lblk = (int)(pos / bs);
+		n = (size_t)(cap - ino->pending_len);
+		if (n > size - done)
+			n = size - done;
+		/* hold a block for each block of the buffer these bytes reach into */
+		more = pending_blocks(s, ino->pending_len + (int)n) - pending_blocks(s, ino->pending_len);
+		if (more > 0 && myfs_blocks_hold(s, more) != 0)
+			return done ? (ssize_t)done : -ENOSPC;
+		memcpy(ino->pending + ino->pending_len, buf + done, n);
+		ino->pending_len += (int)n;
+		done += n;
+		if (ino->pending_len == cap)
+			inode_commit_pending(s, ino);
+	}
+	return (ssize_t)done;
+}
+
+ssize_t inode_write(struct myfs_state *s, struct inode *ino, const char *buf,
+		    size_t size, off_t offset)
+{
+	if (s->delalloc_blocks > 0 && size > 0 && offset == ino->size && !inode_inline_data(s, ino))
+		return write_delayed(s, ino, buf, size, offset);
+	return write_in_place(s, ino, buf, size, offset);
+}
+
+int inode_commit_pending(struct myfs_state *s, struct inode *ino)
+{
+	const int bs = s->DATA_BLOCK_SIZE;
+	int l, n, len, res;
+	char *block;
+
+	if (ino->pending_len == 0)
+		return 0;
+	n = pending_blocks(s, ino->pending_len);
+	res = myfs_blocks_commit(s, ino, ino->pending_lblk, n);
+	if (res != 0)
+		return res;
+	for (l = 0; l < n; l++) {
+		block = s->data_blocks[inode_block_at(ino, ino->pending_lblk + l)].data;
+		len = ino->pending_len - l * bs < bs ? ino->pending_len - l * bs : bs;
+		memcpy(block, ino->pending + (size_t)l * (size_t)bs, (size_t)len);
+		memset(block + len, 0, (size_t)(bs - len));
+	}
+	ino->pending_len = 0;
+	return 0;
+}
+
+void inode_drop_pending(struct myfs_state *s, struct inode *ino)
+{
+	if (ino->pending_len > 0)
+		myfs_blocks_hold(s, -pending_blocks(s, ino->pending_len));
+	ino->pending_len = 0;
+	free(ino->pending);
+	ino->pending = NULL;
+}
+
+int inode_rdlock_committed(struct myfs_state *s, struct inode *ino)
+{
+	int res;
+
+	for (;;) {
+		pthread_rwlock_rdlock(&ino->lock);
+		if (ino->pending_len == 0)
+			return 0;
+		pthread_rwlock_unlock(&ino->lock);
+		pthread_rwlock_wrlock(&ino->lock);
+		res = inode_commit_pending(s, ino);
+		pthread_rwlock_unlock(&ino->lock);
+		if (res != 0)
+			return res;
+	}
+}
+
+ssize_t inode_append(struct myfs_state *s, struct inode *ino, off_t file_size,
+		     const char *buf, size_t size)
+{
+	return inode_write(s, ino, buf, size, file_size);
+}
@@ -0,0 +1,480 @@
+/*
+  Metadata journal for volume images.
+
+  Every metadata change since the image's last checkpoint (image_sync) is
+  logged as a redo record to IMAGE.journal; mounting an image that was not
+  unmounted cleanly rebuilds the checkpoint and replays the records after
+  it. File data is not journaled: it is written in place in the mapped
+  data region, so a crash can leave a file's last blocks stale, but never
+  blocks owned twice, leaked, or mapped past a file's size. Timestamps are
+  not journaled either: a replayed change stamps its file with the time of
+  the recovery.
+
+  Commits use group commit: the first thread to need its records on disk
+  writes out everything logged so far and syncs it once, and threads that
+  logged meanwhile just wait for that sync.
+*/
+
+#include "params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "MYFSJNL"
+
+/* Starts the file: records follow only for the checkpoint with this seq */
+struct journal_header {
+	char magic[8];
+	uint64_t seq;
+};
+
+struct journal_rec {
+	uint32_t len;		/* header and path, padded to 8 bytes */
+	uint32_t type;
+	int32_t inode;
+	int32_t lblk;		/* JOURNAL_BLOCKS: file block of data block a */
+	int64_t a;
+	int64_t b;
+	uint64_t hash;		/* FNV-1a of the record with hash zeroed */
+};
+
+/* lsn just past the last record this thread logged, and whether it has
+ * logged since its last commit */
+static __thread uint64_t thread_lsn;
+static __thread int thread_pending;
+
+static uint64_t rec_hash(const char *data, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (len--) {
+		h ^= (unsigned char)*data++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static void journal_header_init(struct journal_header *h, uint64_t seq)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	h->seq = seq;
+}
+
+int journal_start(struct myfs_state *s, int group)
+{
+	struct journal *j = &s->journal;
+	struct journal_header h;
+	char path[PATH_MAX];
+	int fd;
+
+	if (!s->image_path)
+		return -EINVAL;
+	snprintf(path, sizeof(path), "%s.journal", s->image_path);
+	/* image_open has replayed anything in it already */
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	journal_header_init(&h, j->seq);
+	if (write_all(fd, (const char *)&h, sizeof(h)) != 0 || fdatasync(fd) != 0) {
+		close(fd);
+		return -EIO;
+	}
+	j->fd = fd;
+	j->group = group;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->done, NULL);
+	return 0;
+}
+
+void journal_stop(struct myfs_state *s)
+{
+	struct journal *j = &s->journal;
+
+	if (j->fd < 0)
+		return;
+	close(j->fd);
+	j->fd = -1;
+	free(j->buf);
+	j->buf = NULL;
+	j->len = j->cap = 0;
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->done);
+}
+
+/* Append r followed by plen bytes of path (its terminating NULs included) */
+static void journal_log(struct journal *j, struct journal_rec r, const char *path, size_t plen)
+{
+	size_t len = (sizeof(r) + plen + 7) & ~(size_t)7;
+	size_t cap;
+	char *rec;
+
+	r.len = (uint32_t)len;
+	pthread_mutex_lock(&j->lock);
+	if (j->len + len > j->cap) {
+		cap = j->cap ? j->cap : 4096;
+		while (cap < j->len + len)
+			cap *= 2;
+		rec = (char *)realloc(j->buf, cap);
+		if (!rec) {
+			/* the next commit fails rather than losing the change silently */
+			j->committing = -1;
+			pthread_mutex_unlock(&j->lock);
+			return;
+		}
+		j->buf = rec;
+		j->cap = cap;
+	}
+	rec = j->buf + j->len;
+	memset(rec, 0, len);
+	memcpy(rec, &r, sizeof(r));
+	if (plen)
+		memcpy(rec + sizeof(r), path, plen);
+	r.hash = rec_hash(rec, len);
+	memcpy(rec + offsetof(struct journal_rec, hash), &r.hash, sizeof(r.hash));
+	j->len += len;
+	j->next_lsn += len;
+	thread_lsn = j->next_lsn;
+	thread_pending = 1;
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_note(struct myfs_state *s, enum journal_type type, int inode,
+		  int64_t a, int64_t b, const char *path)
+{
+	struct journal_rec r;
+
+	if (s->journal.fd < 0)
+		return;
+	memset(&r, 0, sizeof(r));
+	r.type = (uint32_t)type;
+	r.inode = inode;
+	r.a = a;
+	r.b = b;
+	journal_log(&s->journal, r, path, path ? strlen(path) + 1 : 0);
+}
+
+void journal_note_blocks(struct myfs_state *s, int inode, int lblk, int start, int n)
+{
+	struct journal_rec r;
+
+	if (s->journal.fd < 0)
+		return;
+	memset(&r, 0, sizeof(r));
+	r.type = JOURNAL_BLOCKS;
+	r.inode = inode;
+	r.lblk = lblk;
+	r.a = start;
+	r.b = n;
+	journal_log(&s->journal, r, NULL, 0);
+}
+
+/* The record carries both paths, each NUL-terminated */
+void journal_note_rename(struct myfs_state *s, const char *from, const char *to)
+{
+	struct journal_rec r;
+	size_t flen = strlen(from) + 1, tlen = strlen(to) + 1;
+	char *paths;
+
+	if (s->journal.fd < 0)
+		return;
+	paths = (char *)malloc(flen + tlen);
+	if (!paths) {
+		pthread_mutex_lock(&s->journal.lock);
+		s->journal.committing = -1;
+		pthread_mutex_unlock(&s->journal.lock);
+		return;
+	}
+	memcpy(paths, from, flen);
+	memcpy(paths + flen, to, tlen);
+	memset(&r, 0, sizeof(r));
+	r.type = JOURNAL_RENAME;
+	r.inode = -1;
+	journal_log(&s->journal, r, paths, flen + tlen);
+	free(paths);
+}
+
+int journal_commit(struct myfs_state *s)
+{
+	struct journal *j = &s->journal;
+	uint64_t target;
+	char *buf;
+	size_t len;
+	int res = 0;
+
+	if (j->fd < 0 || !thread_pending)
+		return 0;
+	thread_pending = 0;
+	pthread_mutex_lock(&j->lock);
+	for (;;) {
+		if (j->committing < 0) {
+			res = -ENOMEM;
+			break;
+		}
+		/* without group commit, every commit leads its own sync */
+		if (j->group && j->durable_lsn >= thread_lsn)
+			break;
+		if (j->committing) {
+			pthread_cond_wait(&j->done, &j->lock);
+			continue;
+		}
+		/* lead: take everything logged so far, then write it unlocked */
+		j->committing = 1;
+		buf = j->buf;
+		len = j->len;
+		target = j->next_lsn;
+		j->buf = NULL;
+		j->len = j->cap = 0;
+		pthread_mutex_unlock(&j->lock);
+
+		if ((len && write_all(j->fd, buf, len) != 0) || fdatasync(j->fd) != 0)
+			res = -errno;
+		free(buf);
+
+		pthread_mutex_lock(&j->lock);
+		j->syncs++;
+		if (res == 0 && target > j->durable_lsn)
+			j->durable_lsn = target;
+		j->committing = 0;
+		pthread_cond_broadcast(&j->done);
+		if (res != 0 || !j->group)
+			break;
+	}
+	pthread_mutex_unlock(&j->lock);
+	return res;
+}
+
+uint64_t journal_size(struct myfs_state *s)
+{
+	struct journal *j = &s->journal;
+	uint64_t n;
+
+	if (j->fd < 0)
+		return 0;
+	pthread_mutex_lock(&j->lock);
+	n = j->next_lsn - j->checkpoint_lsn;
+	pthread_mutex_unlock(&j->lock);
+	return n;
+}
+
+int journal_reset(struct myfs_state *s, const char *path, uint64_t seq)
+{
+	struct journal *j = &s->journal;
+	struct journal_header h;
+	int fd = j->fd, res = 0;
+
+	journal_header_init(&h, seq);
+	j->seq = seq;
+	if (fd < 0) {
+		/* not journaling this mount: just retire an old journal */
+		if (access(path, F_OK) != 0)
+			return 0;
+		fd = open(path, O_WRONLY | O_TRUNC);
+		if (fd < 0)
+			return -errno;
+		close(fd);
+		return 0;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	while (j->committing > 0)
+		pthread_cond_wait(&j->done, &j->lock);
+	/* the checkpoint holds everything logged so far */
+	j->len = 0;
+	j->committing = 0;
+	j->durable_lsn = j->next_lsn;
+	j->checkpoint_lsn = j->next_lsn;
+	if (ftruncate(fd, 0) != 0 || write_all(fd, (const char *)&h, sizeof(h)) != 0)
+		res = -errno;
+	pthread_cond_broadcast(&j->done);
+	pthread_mutex_unlock(&j->lock);
+	return res;
+}
+
+/* Drop the data blocks of ino from file block lblk on, like
+ * myfs_blocks_truncate but with no change to note */
+static void replay_free_blocks(struct myfs_state *s, struct inode *ino, int lblk)
+{
+	const struct extent *e;
+	int i, from;
+
+	for (i = ino->num_extents - 1; i >= 0; i--) {
+		e = &ino->extents[i];
+		if (e->logical + e->length <= lblk)
+			break;
+		from = e->logical < lblk ? lblk - e->logical : 0;
+		myfs_blocks_put(s, e->start + from, e->length - from, 0);
+	}
+	inode_unmap_from(ino, lblk);
+}
+
+/* Replay a rename of path to the path after it in its plen bytes. Any
+ * directory the target needs is made first: directories made since the
+ * checkpoint are not journaled. */
+static int replay_rename(struct myfs_state *s, const char *path, size_t plen)
+{
+	size_t len = strnlen(path, plen);
+	const char *to = path + len + 1;
+	char parent[PATH_MAX];
+	const char *slash;
+
+	if (len + 1 >= plen || strnlen(to, plen - len - 1) == plen - len - 1)
+		return -1;
+	slash = strrchr(to, '/');
+	if (!slash || (size_t)(slash - to) >= sizeof(parent))
+		return -1;
+	memcpy(parent, to, (size_t)(slash - to));
+	parent[slash - to] = '\0';
+	if (slash != to && !dentry_lookup(s, parent) && !dentry_add(s, parent, -1))
+		return -1;
+	return myfs_path_rename(s, path, to, 0) == 0 ? 0 : -1;
+}
+
+static int replay_one(struct myfs_state *s, const struct journal_rec *r, const char *path,
+		      size_t plen)
+{
+	struct inode *ino;
+	int64_t b;
+	int old;
+
+	if (r->type == JOURNAL_RENAME)
+		return path ? replay_rename(s, path, plen) : -1;
+	if (r->inode < 0 || r->inode >= s->NUM_INODES)
+		return -1;
+	ino = &s->inodes[r->inode];
+	switch (r->type) {
+	case JOURNAL_CREATE:
+		if (!path)
+			return -1;
+		bitmap_set(&s->inode_bitmap, r->inode);
+		replay_free_blocks(s, ino, 0);
+		ino->size = 0;
+		ino->mode = S_IFREG | ((mode_t)r->a & 07777);
+		inode_touch(ino, 1);
+		return path_to_inode_add(s, path, r->inode) == 0 ? 0 : -1;
+	case JOURNAL_BLOCKS:
+		if (r->a < 0 || r->b <= 0 || r->a > s->NUM_DATA_BLOCKS - r->b ||
+		    r->lblk < 0 || r->lblk > INT_MAX - r->b)
+			return -1;
+		for (b = 0; b < r->b; b++) {
+			/* a mapped file block got a copy of a shared block */
+			old = inode_block_at(ino, r->lblk + (int)b);
+			if (old >= 0 ? inode_remap_block(ino, r->lblk + (int)b, (int)(r->a + b)) != 0 :
+			    inode_map_block(ino, r->lblk + (int)b, (int)(r->a + b)) != 0)
+				return -1;
+			if (old >= 0)
+				myfs_blocks_put(s, old, 1, 0);
+			/* a block mapped already was shared by a clone */
+			if (!bitmap_test(&s->data_block_bitmap, (int)(r->a + b)))
+				bitmap_set(&s->data_block_bitmap, (int)(r->a + b));
+			else if (myfs_block_ref(s, (int)(r->a + b)) != 0)
+				return -1;
+		}
+		inode_touch(ino, 0);
+		return 0;
+	case JOURNAL_SIZE:
+		if (r->a < 0)
+			return -1;
+		ino->size = (off_t)r->a;
+		inode_touch(ino, 0);
+		return 0;
+	case JOURNAL_TRUNCATE:
+		if (r->a < 0 || r->a / s->DATA_BLOCK_SIZE >= INT_MAX)
+			return -1;
+		replay_free_blocks(s, ino, (int)((r->a + s->DATA_BLOCK_SIZE - 1) / s->DATA_BLOCK_SIZE));
+		ino->size = (off_t)r->a;
+		inode_touch(ino, 0);
+		return 0;
+	case JOURNAL_UNLINK:
+		if (!path)
+			return -1;
+		replay_free_blocks(s, ino, 0);
+		bitmap_clear(&s->inode_bitmap, r->inode);
+		ino->size = 0;
+		path_to_inode_remove(s, path);
+		return 0;
+	}
+	return -1;
+}
+
+int journal_replay(struct myfs_state *s, const char *path, uint64_t seq)
+{
+	struct journal_header h;
+	struct journal_rec r;
+	struct stat st;
+	char *data = NULL, *rec;
+	size_t pos, len;
+	uint64_t hash;
+	int fd, n = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	len = (size_t)st.st_size;
+	if (len < sizeof(h)) {
+		close(fd);
+		return 0;
+	}
+	data = (char *)malloc(len);
+	if (!data || pread(fd, data, len, 0) != (ssize_t)len) {
+		free(data);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	memcpy(&h, data, sizeof(h));
+	/* a journal left from an older checkpoint is already in the image */
+	if (memcmp(h.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || h.seq != seq) {
+		free(data);
+		return 0;
+	}
+
+	/* a torn or partly written record ends the journal */
+	for (pos = sizeof(h); len - pos >= sizeof(r); pos += r.len) {
+		rec = data + pos;
+		memcpy(&r, rec, sizeof(r));
+		if (r.len < sizeof(r) || r.len % 8 || r.len > len - pos)
+			break;
+		memset(rec + offsetof(struct journal_rec, hash), 0, sizeof(r.hash));
+		hash = rec_hash(rec, r.len);
+		if (hash != r.hash)
+			break;
+		if (r.len > sizeof(r))
+			rec[r.len - 1] = '\0';
+		if (replay_one(s, &r, r.len > sizeof(r) ? rec + sizeof(r) : NULL,
+			       r.len - sizeof(r)) != 0) {
+			free(data);
+			return -1;
+		}
+		n++;
+	}
+	free(data);
+	return n;
+}
@@ -0,0 +1,293 @@
+/*
+  Asynchronous log ring.
+
+  FUSE worker threads append records to a fixed-size byte ring without
+  taking a lock: a record's space is claimed by advancing `reserve` with a
+  compare-and-swap, its bytes are copied in, and its header is then
+  published with a release store. One writer thread drains published
+  records in order and hands them to the kernel with writev(), many
+  records per call. When the ring is full a producer either waits for the
+  writer or drops the record, depending on the overflow policy.
+
+  Layout: each record is an 8-byte header (state, payload length) followed
+  by the payload, padded to 8 bytes. A record never wraps; the tail of the
+  ring is skipped with a padding record instead. The writer zeroes what it
+  consumed, so a header's state is 0 until its producer publishes it.
+*/
+
+#include "params.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define REC_EMPTY 0
+#define REC_DATA 1
+#define REC_PAD 2
+
+#define REC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define REC_HEADER 8
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct rec_header {
+	_Atomic uint32_t state;
+	uint32_t len;
+};
+
+static struct rec_header *rec_at(struct log_ring *r, size_t pos)
+{
+	return (struct rec_header *)(r->buf + (pos & r->mask));
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		data += n;
+		len -= (size_t)n;
+	}
+}
+
+/* writev that finishes partial writes */
+static void writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = writev(fd, iov, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+}
+
+static void wait_a_little(pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 10 * 1000 * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(cond, lock, &ts);
+}
+
+/* Write out every published record from tail on; returns 0 if there were none */
+static int drain(struct log_ring *r)
+{
+	struct iovec iov[IOV_MAX];
+	struct rec_header *h;
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t pos = tail, reserve = atomic_load_explicit(&r->reserve, memory_order_acquire);
+	unsigned long dropped;
+	uint32_t state;
+	int cnt = 0;
+	char note[64];
+
+	dropped = atomic_exchange(&r->dropped, 0);
+	if (dropped > 0) {
+		snprintf(note, sizeof(note), "LOG: %lu records dropped\n", dropped);
+		write_all(r->fd, note, strlen(note));
+	}
+
+	while (pos != reserve && cnt < IOV_MAX) {
+		h = rec_at(r, pos);
+		state = atomic_load_explicit(&h->state, memory_order_acquire);
+		if (state == REC_EMPTY)
+			break;	/* claimed but not yet published */
+		if (state == REC_DATA) {
+			iov[cnt].iov_base = (char *)h + REC_HEADER;
+			iov[cnt].iov_len = h->len;
+			cnt++;
+			pos += REC_HEADER + REC_ALIGN(h->len);
+		} else {
+			pos += h->len;
+		}
+	}
+	if (pos == tail)
+		return 0;
+	writev_all(r->fd, iov, cnt);
+
+	/* zero what was consumed (it never wraps inside a record) */
+	while (tail != pos) {
+		size_t off = tail & r->mask;
+		size_t len = pos - tail < r->size - off ? pos - tail : r->size - off;
+
+		memset(r->buf + off, 0, len);
+		tail += len;
+	}
+	atomic_store(&r->tail, pos);
+	if (atomic_load(&r->producers_waiting) > 0) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_broadcast(&r->space);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return 1;
+}
+
+static void *writer_main(void *arg)
+{
+	struct log_ring *r = (struct log_ring *)arg;
+
+	for (;;) {
+		if (drain(r))
+			continue;
+		if (atomic_load(&r->stopping))
+			break;
+		pthread_mutex_lock(&r->lock);
+		atomic_store(&r->writer_sleeping, 1);
+		/* re-check after announcing the sleep, or a wakeup could be lost;
+		 * a claimed but unpublished record is waited for, not spun on */
+		if (atomic_load(&rec_at(r, atomic_load(&r->tail))->state) == REC_EMPTY &&
+		    !atomic_load(&r->stopping))
+			wait_a_little(&r->lock, &r->data);
+		atomic_store(&r->writer_sleeping, 0);
+		pthread_mutex_unlock(&r->lock);
+	}
+	/* pick up anything published while stopping */
+	while (drain(r))
+		;
+	return NULL;
+}
+
+int log_ring_start(struct log_ring *r, int fd, size_t size, enum log_overflow overflow)
+{
+	size_t cap = 4096;
+
+	while (cap < size)
+		cap <<= 1;
+	memset(r, 0, sizeof(*r));
+	r->buf = (char *)calloc(1, cap);
+	if (!r->buf)
+		return -1;
+	r->size = cap;
+	r->mask = cap - 1;
+	r->fd = fd;
+	r->overflow = overflow;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->data, NULL);
+	pthread_cond_init(&r->space, NULL);
+	if (pthread_create(&r->thread, NULL, writer_main, r) != 0) {
+		free(r->buf);
+		r->buf = NULL;
+		return -1;
+	}
+	r->running = 1;
+	return 0;
+}
+
+void log_ring_stop(struct log_ring *r)
+{
+	if (!r->running)
+		return;
+	pthread_mutex_lock(&r->lock);
+	atomic_store(&r->stopping, 1);
+	pthread_cond_signal(&r->data);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	r->running = 0;
+	pthread_cond_destroy(&r->data);
+	pthread_cond_destroy(&r->space);
+	pthread_mutex_destroy(&r->lock);
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/* Publish one record of at most half the ring */
+static void put_record(struct log_ring *r, const char *data, size_t len)
+{
+	size_t need = REC_HEADER + REC_ALIGN(len), pos, tail, off, pad;
+	struct rec_header *h;
+
+	for (;;) {
+		pos = atomic_load_explicit(&r->reserve, memory_order_relaxed);
+		tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		off = pos & r->mask;
+		pad = r->size - off < need ? r->size - off : 0;
+		if (pos + pad + need - tail > r->size) {
+			if (r->overflow == LOG_OVERFLOW_DROP) {
+				atomic_fetch_add(&r->dropped, 1);
+				return;
+			}
+			pthread_mutex_lock(&r->lock);
+			atomic_fetch_add(&r->producers_waiting, 1);
+			if (atomic_load(&r->tail) == tail)
+				wait_a_little(&r->lock, &r->space);
+			atomic_fetch_sub(&r->producers_waiting, 1);
+			pthread_mutex_unlock(&r->lock);
+			continue;
+		}
+		if (atomic_compare_exchange_weak_explicit(&r->reserve, &pos, pos + pad + need,
+							  memory_order_acq_rel, memory_order_relaxed))
+			break;
+	}
+	if (pad) {
+		h = rec_at(r, pos);
+		h->len = (uint32_t)pad;
+		atomic_store_explicit(&h->state, REC_PAD, memory_order_release);
+		pos += pad;
+	}
+	h = rec_at(r, pos);
+	memcpy((char *)h + REC_HEADER, data, len);
+	h->len = (uint32_t)len;
+	atomic_store(&h->state, REC_DATA);
+
+	if (atomic_load(&r->writer_sleeping)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->data);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+void log_ring_write(struct log_ring *r, const char *data, size_t len)
+{
+	size_t chunk;
+
+	/* oversized writes go in as several records */
+	while (len > 0) {
+		chunk = len < r->size / 2 - REC_HEADER ? len : r->size / 2 - REC_HEADER;
+		put_record(r, data, chunk);
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+void log_ring_flush(struct log_ring *r)
+{
+	if (!r->running)
+		return;
+	while (atomic_load(&r->tail) != atomic_load(&r->reserve)) {
+		pthread_mutex_lock(&r->lock);
+		atomic_fetch_add(&r->producers_waiting, 1);
+		if (atomic_load(&r->writer_sleeping))
+			pthread_cond_signal(&r->data);
+		if (atomic_load(&r->tail) != atomic_load(&r->reserve))
+			wait_a_little(&r->lock, &r->space);
+		atomic_fetch_sub(&r->producers_waiting, 1);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
@@ -0,0 +1,963 @@
+/*
+  Microbenchmarks for the myfs in-memory structures.
+
+  usage: myfs_bench [benchmark...]   (no arguments runs all of them)
+*/
+
+#include "params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/* path_to_inode_lookup latency as the table grows from 10 to 1M entries */
+static void bench_path(void)
+{
+	static const int sizes[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+	const int lookups = 1000000;
+	size_t n;
+	int i, hits;
+	double t0, t1;
+
+	printf("path_to_inode_lookup (%d random hits per size)\n", lookups);
+	printf("%10s %12s\n", "entries", "ns/lookup");
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		int count = sizes[n];
+		struct myfs_state *s = myfs_state_create(NULL, ".", NULL, count, 1, 1, 0);
+		char **paths = (char **)malloc((size_t)count * sizeof(char *));
+		int *order = (int *)malloc((size_t)lookups * sizeof(int));
+
+		if (!s || !paths || !order) {
+			fprintf(stderr, "out of memory at %d entries\n", count);
+			exit(1);
+		}
+		for (i = 0; i < count; i++) {
+			char p[64];
+			snprintf(p, sizeof(p), "/dir%d/file%08d.txt", i % 64, i);
+			paths[i] = strdup(p);
+			path_to_inode_add(s, paths[i], i);
+		}
+		for (i = 0; i < lookups; i++)
+			order[i] = (int)(rng_next() % (uint64_t)count);
+
+		hits = 0;
+		t0 = now_ns();
+		for (i = 0; i < lookups; i++)
+			hits += path_to_inode_lookup(s, paths[order[i]]) == order[i];
+		t1 = now_ns();
+		if (hits != lookups)
+			fprintf(stderr, "lookup mismatch: %d/%d\n", hits, lookups);
+		printf("%10d %12.1f\n", count, (t1 - t0) / lookups);
+
+		for (i = 0; i < count; i++)
+			free(paths[i]);
+		free(paths);
+		free(order);
+		myfs_state_destroy(s);
+	}
+}
+
+/*
+ * Lowest-free allocation in a 1M-block volume kept ~90% full: each op frees a
+ * random block and allocates the lowest free one. Compared with the linear
+ * scan over an int array that the bitmap replaced.
+ */
+static void bench_bitmap(void)
+{
+	const int nblocks = 1 << 20, ops = 200000;
+	struct bitmap b;
+	int *flat = (int *)calloc((size_t)nblocks, sizeof(int));
+	int i, k, found;
+	double t0, t1, t2;
+
+	if (!flat || bitmap_init(&b, nblocks) != 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nblocks; i++) {
+		if (rng_next() % 10) {
+			bitmap_set(&b, i);
+			flat[i] = 1;
+		}
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < ops; i++) {
+		bitmap_clear(&b, (int)(rng_next() % (uint64_t)nblocks));
+		found = bitmap_find_first_zero(&b);
+		if (found >= 0)
+			bitmap_set(&b, found);
+	}
+	t1 = now_ns();
+	for (i = 0; i < ops / 100; i++) {
+		flat[rng_next() % (uint64_t)nblocks] = 0;
+		for (k = 0; k < nblocks && flat[k]; k++)
+			;
+		if (k < nblocks)
+			flat[k] = 1;
+	}
+	t2 = now_ns();
+
+	printf("lowest-free allocation, %d blocks, %d free\n", nblocks, b.nfree);
+	printf("%-12s %12.1f ns/op\n", "bitmap", (t1 - t0) / ops);
+	printf("%-12s %12.1f ns/op\n", "int scan", (t2 - t1) / (ops / 100));
+	free(flat);
+	bitmap_free(&b);
+}
+
+/* myfs_state_create (mount-time setup) for growing volumes of 4 KB blocks */
+static void bench_create(void)
+{
+	static const int sizes[] = { 1024, 16384, 262144, 1048576 };
+	size_t n;
+	double t0, t1;
+
+	printf("myfs_state_create, 16 inodes, 4096-byte blocks\n");
+	printf("%10s %12s\n", "blocks", "ms");
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		struct myfs_state *s;
+
+		t0 = now_ns();
+		s = myfs_state_create(NULL, ".", NULL, 16, sizes[n], 4096, 0);
+		t1 = now_ns();
+		if (!s) {
+			fprintf(stderr, "myfs_state_create failed at %d blocks\n", sizes[n]);
+			exit(1);
+		}
+		printf("%10d %12.2f\n", sizes[n], (t1 - t0) / 1e6);
+		myfs_state_destroy(s);
+	}
+}
+
+/* Mounting an existing volume image (a 1 MB file on it) vs volume size */
+static void bench_mount(void)
+{
+	static const int sizes[] = { 1024, 16384, 262144, 1048576 };
+	char image[] = "/tmp/myfs_bench.XXXXXX";
+	char *data = (char *)calloc(1, 1 << 20);
+	size_t n;
+	int fd, i;
+	double t0, t1;
+
+	fd = mkstemp(image);
+	if (fd < 0 || !data) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+	printf("mount from a volume image, 16 inodes, 4096-byte blocks\n");
+	printf("%10s %12s\n", "blocks", "ms");
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		struct myfs_state *s;
+
+		if (truncate(image, 0) != 0)
+			exit(1);
+		s = myfs_state_create(NULL, ".", image, 16, sizes[n], 4096, 0);
+		if (!s) {
+			fprintf(stderr, "myfs_state_create failed at %d blocks\n", sizes[n]);
+			exit(1);
+		}
+		i = myfs_file_create(s, "/file", 0644);
+		if (i >= 0 && inode_append(s, &s->inodes[i], 0, data, 1 << 20) >= 0)
+			s->inodes[i].size = 1 << 20;
+		if (i < 0 || s->inodes[i].size != 1 << 20 || image_sync(s, 1) != 0) {
+			fprintf(stderr, "could not write the image at %d blocks\n", sizes[n]);
+			exit(1);
+		}
+		myfs_state_destroy(s);
+
+		t0 = now_ns();
+		s = myfs_state_create(NULL, ".", image, 16, sizes[n], 4096, 0);
+		t1 = now_ns();
+		if (!s || path_to_inode_lookup(s, "/file") != i) {
+			fprintf(stderr, "remount failed at %d blocks\n", sizes[n]);
+			exit(1);
+		}
+		printf("%10d %12.2f\n", sizes[n], (t1 - t0) / 1e6);
+		myfs_state_destroy(s);
+	}
+	unlink(image);
+	free(data);
+}
+
+/*
+ * Build a one-inode file of nblocks blocks straight into the block map (the
+ * arena pages stay untouched). fragmented maps blocks 0, 2, 4, ... then
+ * 1, 3, 5, ... so every extent is a single block.
+ */
+static struct myfs_state *read_bench_file(int nblocks, int bs, int fragmented)
+{
+	struct myfs_state *s = myfs_state_create(NULL, ".", NULL, 1, nblocks, bs, 0);
+	int i, b;
+
+	if (!s) {
+		fprintf(stderr, "myfs_state_create failed at %d blocks\n", nblocks);
+		exit(1);
+	}
+	for (i = 0; i < nblocks; i++) {
+		b = !fragmented ? i : i < (nblocks + 1) / 2 ? 2 * i : 2 * (i - (nblocks + 1) / 2) + 1;
+		bitmap_set(&s->data_block_bitmap, b);
+		if (inode_append_block(&s->inodes[0], b) != 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	return s;
+}
+
+/* The pre-extent read path: walk the block list from block 0 */
+static off_t walk_from_zero(const int *blocks, int nblocks, int bs, off_t offset)
+{
+	off_t block_offset = 0;
+	int i;
+
+	for (i = 0; i < nblocks; i++) {
+		if (block_offset + bs > offset)
+			return blocks[i];
+		block_offset += bs;
+	}
+	return -1;
+}
+
+/* Random-offset 4 KB inode_read latency as the file grows to 16 GB */
+static void bench_read(void)
+{
+	static const int sizes_mb[] = { 1, 16, 256, 1024, 4096, 16384 };
+	const int bs = 4096, reads = 200000;
+	char buf[4096];
+	off_t *offs = (off_t *)malloc((size_t)reads * sizeof(off_t));
+	size_t n;
+	int i, frag;
+	double t0, t1;
+
+	if (!offs) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	printf("random 4 KB reads, %d per size (ns/read)\n", reads);
+	printf("%10s %12s %12s %12s\n", "file MB", "contiguous", "fragmented", "walk blk 0");
+	for (n = 0; n < sizeof(sizes_mb) / sizeof(sizes_mb[0]); n++) {
+		int nblocks = (int)((long long)sizes_mb[n] * (1 << 20) / bs);
+		off_t file_size = (off_t)nblocks * bs;
+		double ns[3] = { 0, 0, -1 };
+
+		for (frag = 0; frag < 2; frag++) {
+			struct myfs_state *s = read_bench_file(nblocks, bs, frag);
+
+			/* fault in the (zero) arena pages the reads touch before
+			 * timing: memfd pages are allocated on first access */
+			for (i = 0; i < reads; i++) {
+				offs[i] = (off_t)(rng_next() % (uint64_t)file_size);
+				inode_read(s, &s->inodes[0], file_size, buf, sizeof(buf), offs[i]);
+			}
+			t0 = now_ns();
+			for (i = 0; i < reads; i++)
+				inode_read(s, &s->inodes[0], file_size, buf, sizeof(buf), offs[i]);
+			t1 = now_ns();
+			ns[frag] = (t1 - t0) / reads;
+			myfs_state_destroy(s);
+		}
+		if (nblocks <= 65536) {
+			int *blocks = (int *)malloc((size_t)nblocks * sizeof(int));
+			volatile off_t sink = 0;
+
+			for (i = 0; i < nblocks; i++)
+				blocks[i] = i;
+			t0 = now_ns();
+			for (i = 0; i < reads / 100; i++)
+				sink += walk_from_zero(blocks, nblocks, bs,
+						       (off_t)(rng_next() % (uint64_t)file_size));
+			t1 = now_ns();
+			(void)sink;
+			ns[2] = (t1 - t0) / (reads / 100);
+			free(blocks);
+		}
+		printf("%10d %12.1f %12.1f ", sizes_mb[n], ns[0], ns[1]);
+		if (ns[2] >= 0)
+			printf("%12.1f\n", ns[2]);
+		else
+			printf("%12s\n", "-");
+	}
+	free(offs);
+}
+
+/*
+ * Large sequential reads, 128 KB (FUSE's default max_read) at a time, of a
+ * 1 GB file, handed to the kernel two ways. A pipe stands in for
+ * /dev/fuse, and reading it into the caller's buffer for FUSE's copy into
+ * the reading process:
+ *   copy    read into a buffer, then write the buffer to the pipe (myfs_read
+ *           and myfs_read_buf)
+ *   splice  splice each extent run from the arena's memfd, which would need
+ *           the blocks kept from reuse until the reply is sent
+ */
+static void bench_seqread(void)
+{
+	const int bs = 4096, nblocks = 262144, passes = 4;
+	const size_t chunk = 128 << 10;
+	const off_t file_size = (off_t)nblocks * bs;
+	struct myfs_state *s = read_bench_file(nblocks, bs, 0);
+	struct iovec iov[64];
+	char *buf = (char *)malloc(chunk), *out = (char *)malloc(chunk);
+	double t0, t1, gbs[2];
+	int pipefd[2], mode, pass, i, n;
+	off_t off, pos;
+	ssize_t r;
+
+	if (!buf || !out || s->block_arena_fd < 0 || pipe(pipefd) != 0 ||
+	    fcntl(pipefd[1], F_SETPIPE_SZ, (int)chunk) < (int)chunk) {
+		fprintf(stderr, "seqread: no memfd arena or pipe\n");
+		exit(1);
+	}
+	memset(s->block_arena, 'x', s->block_arena_size);
+	for (mode = 0; mode < 2; mode++) {
+		t0 = now_ns();
+		for (pass = 0; pass < passes; pass++) {
+			for (off = 0; off < file_size; off += (off_t)chunk) {
+				if (mode == 0) {
+					inode_read(s, &s->inodes[0], file_size, buf, chunk, off);
+					r = write(pipefd[1], buf, chunk);
+				} else {
+					n = inode_iovec(s, &s->inodes[0], file_size, off, chunk, iov, 64);
+					for (i = 0, r = 0; i < n; i++) {
+						pos = s->block_arena_off + ((char *)iov[i].iov_base - s->block_arena);
+						r += splice(s->block_arena_fd, &pos, pipefd[1], NULL,
+							    iov[i].iov_len, SPLICE_F_MOVE);
+					}
+				}
+				if (r != (ssize_t)chunk || read(pipefd[0], out, chunk) != (ssize_t)chunk) {
+					fprintf(stderr, "seqread: short transfer\n");
+					exit(1);
+				}
+			}
+		}
+		t1 = now_ns();
+		gbs[mode] = (double)file_size * passes / (t1 - t0);
+	}
+	printf("sequential 128 KB reads of a %d MB file (GB/s)\n", (int)(file_size >> 20));
+	printf("%12s %12s\n", "copy", "splice");
+	printf("%12.2f %12.2f\n", gbs[0], gbs[1]);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	free(buf);
+	free(out);
+	myfs_state_destroy(s);
+}
+
+/*
+ * Database-style page updates: random 4 KB-aligned pwrites over a 64 MB
+ * file, in rounds. Before offset writes every write appended, so the file
+ * and its block count grew by the bytes written; now both stay put.
+ */
+static void bench_overwrite(void)
+{
+	const int bs = 4096, nblocks = 16384, rounds = 5, writes = 200000;
+	struct myfs_state *s = myfs_state_create(NULL, ".", NULL, 1, 2 * nblocks, bs, 0);
+	char page[4096];
+	off_t size = 0, off;
+	int r, i, used;
+	double t0, t1;
+
+	if (!s || myfs_file_create(s, "/db", 0644) != 0) {
+		fprintf(stderr, "myfs_state_create failed\n");
+		exit(1);
+	}
+	memset(page, 'p', sizeof(page));
+	for (i = 0; i < nblocks; i++, size += bs)
+		inode_write(s, &s->inodes[0], page, sizeof(page), size);
+	printf("random 4 KB overwrites of a %d MB file, %d per round\n", nblocks * bs >> 20, writes);
+	printf("%6s %12s %12s %12s\n", "round", "ns/write", "blocks used", "file MB");
+	for (r = 1; r <= rounds; r++) {
+		t0 = now_ns();
+		for (i = 0; i < writes; i++) {
+			off = (off_t)(rng_next() % (uint64_t)nblocks) * bs;
+			if (inode_write(s, &s->inodes[0], page, sizeof(page), off) < 0) {
+				fprintf(stderr, "overwrite failed\n");
+				exit(1);
+			}
+			if (off + bs > size)
+				size = off + bs;
+		}
+		t1 = now_ns();
+		used = 2 * nblocks - s->data_block_bitmap.nfree;
+		printf("%6d %12.1f %12d %12lld\n", r, (t1 - t0) / writes, used, (long long)(size >> 20));
+	}
+	myfs_state_destroy(s);
+}
+
+/*
+ * Journaled appends: each thread appends 64 bytes to its own file per
+ * operation and the operation returns once its records are durable.
+ * The image lives in the current directory, not a possibly tmpfs /tmp,
+ * so that fdatasync costs what it would on a real volume.
+ */
+#define JOURNAL_BENCH_OPS 2000
+
+static struct myfs_state *journal_bench_state;
+
+static void *journal_bench_worker(void *arg)
+{
+	struct myfs_state *s = journal_bench_state;
+	int i = (int)(uintptr_t)arg, n;
+	char data[64];
+
+	memset(data, 'j', sizeof(data));
+	for (n = 0; n < JOURNAL_BENCH_OPS; n++) {
+		myfs_op_begin(s, 0);
+		pthread_rwlock_wrlock(&s->inodes[i].lock);
+		if (inode_append(s, &s->inodes[i], s->inodes[i].size, data, sizeof(data)) >= 0) {
+			s->inodes[i].size += (off_t)sizeof(data);
+			journal_note(s, JOURNAL_SIZE, i, s->inodes[i].size, 0, NULL);
+		}
+		pthread_rwlock_unlock(&s->inodes[i].lock);
+		if (myfs_op_end(s) != 0) {
+			fprintf(stderr, "journal commit failed\n");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+static void bench_journal(void)
+{
+	static const int threads[] = { 1, 4, 16, 64 };
+	pthread_t tid[64];
+	char image[] = "myfs_bench.XXXXXX", journal[sizeof(image) + 8];
+	char path[16];
+	size_t n;
+	int fd, group, t;
+	double ops[2];
+	unsigned long syncs[2];
+	double t0, t1;
+
+	fd = mkstemp(image);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+	snprintf(journal, sizeof(journal), "%s.journal", image);
+	printf("journaled 64-byte appends, %d per thread (ops/s, fdatasyncs)\n", JOURNAL_BENCH_OPS);
+	printf("%8s %12s %8s %12s %8s\n", "threads", "sync/op", "syncs", "group", "syncs");
+	for (n = 0; n < sizeof(threads) / sizeof(threads[0]); n++) {
+		for (group = 0; group < 2; group++) {
+			struct myfs_state *s;
+
+			if (truncate(image, 0) != 0)
+				exit(1);
+			s = myfs_state_create(NULL, ".", image, 64, 64 * 1024, 4096, 0);
+			if (!s || journal_start(s, group) != 0) {
+				fprintf(stderr, "cannot journal %s\n", image);
+				exit(1);
+			}
+			s->log_mode = MYFS_LOG_DELTA;
+			for (t = 0; t < threads[n]; t++) {
+				snprintf(path, sizeof(path), "/f%d", t);
+				myfs_file_create(s, path, 0644);
+			}
+			journal_bench_state = s;
+			s->journal.syncs = 0;
+			t0 = now_ns();
+			for (t = 0; t < threads[n]; t++)
+				pthread_create(&tid[t], NULL, journal_bench_worker, (void *)(uintptr_t)t);
+			for (t = 0; t < threads[n]; t++)
+				pthread_join(tid[t], NULL);
+			t1 = now_ns();
+			ops[group] = (double)threads[n] * JOURNAL_BENCH_OPS / ((t1 - t0) / 1e9);
+			syncs[group] = s->journal.syncs;
+			myfs_state_destroy(s);
+		}
+		printf("%8d %12.0f %8lu %12.0f %8lu\n", threads[n], ops[0], syncs[0], ops[1], syncs[1]);
+	}
+	unlink(image);
+	unlink(journal);
+}
+
+/*
+ * Many tiny files: create 100k files of 1 to 60 bytes each, with and
+ * without an inline area, and count the data blocks they take. Without
+ * one every file holds a 4 KB block; with one none of them does.
+ */
+static void bench_tiny(void)
+{
+	static const int inline_sizes[] = { 0, 64 };
+	const int files = 100000, bs = 4096;
+	struct myfs_state *s;
+	char path[32], data[64];
+	size_t n;
+	off_t len;
+	int i, f;
+	double t0, t1;
+
+	memset(data, 't', sizeof(data));
+	printf("%d files of 1-60 bytes, %d-byte blocks\n", files, bs);
+	printf("%8s %12s %12s %12s\n", "inline", "ns/file", "blocks used", "block MB");
+	for (n = 0; n < sizeof(inline_sizes) / sizeof(inline_sizes[0]); n++) {
+		s = myfs_state_create(NULL, ".", NULL, files, files, bs, inline_sizes[n]);
+		if (!s) {
+			fprintf(stderr, "myfs_state_create failed\n");
+			exit(1);
+		}
+		t0 = now_ns();
+		for (f = 0; f < files; f++) {
+			snprintf(path, sizeof(path), "/t%d", f);
+			i = myfs_file_create(s, path, 0644);
+			len = 1 + (off_t)(rng_next() % 60);
+			if (i < 0 || inode_write(s, &s->inodes[i], data, (size_t)len, 0) < 0) {
+				fprintf(stderr, "tiny file %d failed\n", f);
+				exit(1);
+			}
+			s->inodes[i].size = len;
+		}
+		t1 = now_ns();
+		f = files - s->data_block_bitmap.nfree;
+		printf("%8d %12.0f %12d %12.1f\n", inline_sizes[n], (t1 - t0) / files, f,
+		       (double)f * bs / (1 << 20));
+		myfs_state_destroy(s);
+	}
+}
+
+/*
+ * Listing one directory of 1000 files among 100k in 100 directories: from
+ * its children in the tree, against the scan of every path_to_inode entry
+ * a flat path index would need (here only a parent check per entry).
+ */
+static void bench_readdir(void)
+{
+	const int files = 100000, dirs = 100, listings = 200;
+	struct myfs_state *s;
+	const struct dentry *dir, *c;
+	char path[64];
+	unsigned pos;
+	long found[2] = { 0, 0 };
+	int i, n;
+	double t0, t1, t2;
+
+	s = myfs_state_create(NULL, ".", NULL, files, 1, 1, 0);
+	if (!s) {
+		fprintf(stderr, "myfs_state_create failed\n");
+		exit(1);
+	}
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "/dir%d/file%08d.txt", i % dirs, i);
+		if (myfs_file_create(s, path, 0644) < 0) {
+			fprintf(stderr, "create %s failed\n", path);
+			exit(1);
+		}
+	}
+	t0 = now_ns();
+	for (n = 0; n < listings; n++) {
+		snprintf(path, sizeof(path), "/dir%d", n % dirs);
+		dir = dentry_lookup(s, path);
+		pos = 0;
+		while ((c = dentry_next_child(dir, &pos)) != NULL)
+			found[0] += c->name[0] != '\0';
+	}
+	t1 = now_ns();
+	for (n = 0; n < listings; n++) {
+		snprintf(path, sizeof(path), "/dir%d", n % dirs);
+		dir = dentry_lookup(s, path);
+		for (i = 0; i < s->path_count; i++)
+			found[1] += s->path_to_inode[i].dentry->parent == dir;
+	}
+	t2 = now_ns();
+	if (found[0] != found[1])
+		fprintf(stderr, "listings disagree: %ld vs %ld\n", found[0], found[1]);
+	printf("list a directory of %d among %d files\n", files / dirs, files);
+	printf("%14s %12s\n", "", "us/listing");
+	printf("%14s %12.1f\n", "tree", (t1 - t0) / 1e3 / listings);
+	printf("%14s %12.1f\n", "path scan", (t2 - t1) / 1e3 / listings);
+	myfs_state_destroy(s);
+}
+
+/*
+ * Renaming a directory back and forth as the number of files under it
+ * grows from 10 to 100k: only the directory's dentry moves, so the time
+ * stays flat.
+ */
+static void bench_rename(void)
+{
+	static const int sizes[] = { 10, 1000, 100000 };
+	const int renames = 100000;
+	struct myfs_state *s;
+	char path[64];
+	size_t n;
+	int i, count;
+	double t0, t1;
+
+	printf("rename a directory (%d renames per size)\n", renames);
+	printf("%10s %12s\n", "files", "ns/rename");
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		count = sizes[n];
+		s = myfs_state_create(NULL, ".", NULL, count, 1, 1, 0);
+		if (!s) {
+			fprintf(stderr, "myfs_state_create failed\n");
+			exit(1);
+		}
+		for (i = 0; i < count; i++) {
+			snprintf(path, sizeof(path), "/top/sub%d/file%08d.txt", i % 64, i);
+			myfs_file_create(s, path, 0644);
+		}
+		t0 = now_ns();
+		for (i = 0; i < renames; i++) {
+			if (myfs_path_rename(s, i & 1 ? "/moved" : "/top", i & 1 ? "/top" : "/moved", 0) != 0) {
+				fprintf(stderr, "rename failed\n");
+				exit(1);
+			}
+		}
+		t1 = now_ns();
+		snprintf(path, sizeof(path), "/top/sub%d/file%08d.txt", (count - 1) % 64, count - 1);
+		if (path_to_inode_lookup(s, path) != count - 1)
+			fprintf(stderr, "lookup after renames failed\n");
+		printf("%10d %12.1f\n", count, (t1 - t0) / renames);
+		myfs_state_destroy(s);
+	}
+}
+
+/*
+ * Truncate-to-zero of a 1 GB file, laid out as one extent or as 64 KB
+ * extents interleaved with a second file. Blocks are mapped directly, as
+ * the data written to them plays no part in freeing them.
+ */
+static void bench_truncate(void)
+{
+	const int bs = 4096, nblocks = 262144, rounds = 5;
+	struct myfs_state *s = myfs_state_create(NULL, ".", NULL, 2, 2 * nblocks, bs, 0);
+	int layout, chunk, r, l;
+	double t, best;
+
+	if (!s || myfs_file_create(s, "/a", 0644) != 0 || myfs_file_create(s, "/b", 0644) != 1) {
+		fprintf(stderr, "myfs_state_create failed\n");
+		exit(1);
+	}
+	printf("truncate a %d MB file to zero (best of %d)\n", nblocks * bs >> 20, rounds);
+	printf("%14s %10s %12s\n", "layout", "extents", "us/truncate");
+	for (layout = 0; layout < 2; layout++) {
+		chunk = layout ? 16 : nblocks;
+		best = 1e300;
+		for (r = 0; r < rounds; r++) {
+			for (l = 0; l < nblocks; l += chunk) {
+				myfs_blocks_alloc(s, &s->inodes[0], l, chunk);
+				if (layout)
+					myfs_blocks_alloc(s, &s->inodes[1], l, chunk);
+			}
+			s->inodes[0].size = (off_t)nblocks * bs;
+			l = s->inodes[0].num_extents;
+			t = now_ns();
+			if (myfs_file_truncate(s, 0, 0) != 0) {
+				fprintf(stderr, "truncate failed\n");
+				exit(1);
+			}
+			t = now_ns() - t;
+			if (t < best)
+				best = t;
+			myfs_blocks_free(s, &s->inodes[1]);
+		}
+		printf("%14s %10d %12.1f\n", layout ? "64 KB extents" : "contiguous", l, best / 1e3);
+	}
+	myfs_state_destroy(s);
+}
+
+/*
+ * Interleaved appenders: 8 files each grow to 16 MB by 4 KB appends taken
+ * in turn, as the block maps of log shippers sharing a volume do, with and
+ * without reserving each file's 16 MB up front (FALLOC_FL_KEEP_SIZE).
+ */
+static void bench_fallocate(void)
+{
+	const int bs = 4096, files = 8, per_file = 4096;
+	struct myfs_state *s;
+	char page[4096], path[16];
+	int reserve, f, n, extents;
+	double t0, t1;
+
+	memset(page, 'l', sizeof(page));
+	printf("%d files appended 4 KB at a time in turn to %d MB each\n", files, per_file * bs >> 20);
+	printf("%10s %12s %16s\n", "reserved", "ns/append", "extents/file");
+	for (reserve = 0; reserve < 2; reserve++) {
+		s = myfs_state_create(NULL, ".", NULL, files, files * per_file, bs, 0);
+		if (!s) {
+			fprintf(stderr, "myfs_state_create failed\n");
+			exit(1);
+		}
+		for (f = 0; f < files; f++) {
+			snprintf(path, sizeof(path), "/log%d", f);
+			myfs_file_create(s, path, 0644);
+			if (reserve && myfs_file_fallocate(s, f, 0, (off_t)per_file * bs, 1) != 0) {
+				fprintf(stderr, "fallocate failed\n");
+				exit(1);
+			}
+		}
+		t0 = now_ns();
+		for (n = 0; n < per_file; n++) {
+			for (f = 0; f < files; f++) {
+				if (inode_write(s, &s->inodes[f], page, sizeof(page), (off_t)n * bs) < 0) {
+					fprintf(stderr, "append failed\n");
+					exit(1);
+				}
+				s->inodes[f].size += bs;
+			}
+		}
+		t1 = now_ns();
+		extents = 0;
+		for (f = 0; f < files; f++)
+			extents += s->inodes[f].num_extents;
+		printf("%10s %12.1f %16.1f\n", reserve ? "yes" : "no", (t1 - t0) / (files * per_file),
+		       (double)extents / files);
+		myfs_state_destroy(s);
+	}
+}
+
+/*
+ * Many files, tiny appends: 256 files each grow to 64 KB by 16-byte
+ * appends taken in turn, allocating as they go or through per-inode
+ * buffers of 16 blocks (--delalloc=16), committed when a file is closed.
+ */
+static void bench_delalloc(void)
+{
+	const int bs = 4096, files = 256, per_file = 65536, chunk = 16;
+	static const int buffers[] = { 0, 1, 16 };
+	struct myfs_state *s;
+	char data[16], path[16];
+	int f, n, extents, used;
+	size_t b;
+	double t0, t1;
+
+	memset(data, 'd', sizeof(data));
+	printf("%d files appended %d bytes at a time in turn to %d KB each\n", files, chunk,
+	       per_file >> 10);
+	printf("%10s %12s %16s %12s\n", "delalloc", "ns/append", "extents/file", "blocks used");
+	for (b = 0; b < sizeof(buffers) / sizeof(buffers[0]); b++) {
+		s = myfs_state_create(NULL, ".", NULL, files, files * per_file / bs, bs, 0);
+		if (!s) {
+			fprintf(stderr, "myfs_state_create failed\n");
+			exit(1);
+		}
+		s->delalloc_blocks = buffers[b];
+		for (f = 0; f < files; f++) {
+			snprintf(path, sizeof(path), "/f%d", f);
+			myfs_file_create(s, path, 0644);
+		}
+		t0 = now_ns();
+		for (n = 0; n < per_file; n += chunk) {
+			for (f = 0; f < files; f++) {
+				if (inode_write(s, &s->inodes[f], data, (size_t)chunk, (off_t)n) != chunk) {
+					fprintf(stderr, "append failed\n");
+					exit(1);
+				}
+				s->inodes[f].size += chunk;
+			}
+		}
+		for (f = 0; f < files; f++)
+			inode_commit_pending(s, &s->inodes[f]);
+		t1 = now_ns();
+		extents = 0;
+		for (f = 0; f < files; f++)
+			extents += s->inodes[f].num_extents;
+		used = files * per_file / bs - s->data_block_bitmap.nfree;
+		printf("%10d %12.1f %16.1f %12d\n", buffers[b], (t1 - t0) / ((double)files * per_file / chunk),
+		       (double)extents / files, used);
+		myfs_state_destroy(s);
+	}
+}
+
+/*
+ * Allocation policies under churn: each thread appends 4 to 64 KB at a
+ * time to random files of its own and empties a file once it passes 256 KB,
+ * on a volume with half again the blocks the files can hold. Reports
+ * appends per second and how the files that are left ended up laid out.
+ */
+#define ALLOC_BENCH_FILES 16	/* per thread */
+#define ALLOC_BENCH_BLOCKS 64	/* per file at most */
+#define ALLOC_BENCH_OPS 200000	/* per thread */
+
+static struct myfs_state *alloc_bench_state;
+
+static void *alloc_bench_worker(void *arg)
+{
+	struct myfs_state *s = alloc_bench_state;
+	int t = (int)(uintptr_t)arg, n, i;
+	uint64_t rng = 88172645463325252ull + (uint64_t)t;
+	struct inode *ino;
+	char data[16 * 4096];
+	size_t len;
+
+	memset(data, 'a', sizeof(data));
+	for (n = 0; n < ALLOC_BENCH_OPS; n++) {
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		i = t * ALLOC_BENCH_FILES + (int)(rng % ALLOC_BENCH_FILES);
+		len = (size_t)(1 + (rng >> 32) % 16) * 4096;
+		ino = &s->inodes[i];
+		myfs_op_begin(s, 0);
+		pthread_rwlock_wrlock(&ino->lock);
+		if (ino->size + (off_t)len > (off_t)ALLOC_BENCH_BLOCKS * 4096) {
+			myfs_file_truncate(s, i, 0);
+		} else if (inode_write(s, ino, data, len, ino->size) == (ssize_t)len) {
+			ino->size += (off_t)len;
+		} else {
+			fprintf(stderr, "append failed\n");
+			exit(1);
+		}
+		pthread_rwlock_unlock(&ino->lock);
+		myfs_op_end(s);
+	}
+	return NULL;
+}
+
+static void bench_alloc(void)
+{
+	static const char *const policies[] = { "lowest", "next", "best", "groups" };
+	static const int threads[] = { 1, 4 };
+	pthread_t tid[4];
+	struct myfs_state *s;
+	char path[16];
+	int p, n, t, f, files, extents, mapped;
+	double t0, t1;
+
+	printf("4-64 KB appends to random files emptied at %d KB, %d per thread\n",
+	       ALLOC_BENCH_BLOCKS * 4, ALLOC_BENCH_OPS);
+	printf("%8s %8s %12s %14s %14s\n", "policy", "threads", "appends/s", "extents/file",
+	       "blocks/extent");
+	for (p = 0; p < 4; p++) {
+		for (n = 0; n < (int)(sizeof(threads) / sizeof(threads[0])); n++) {
+			files = threads[n] * ALLOC_BENCH_FILES;
+			s = myfs_state_create(NULL, ".", NULL, files, files * ALLOC_BENCH_BLOCKS * 3 / 2,
+					      4096, 0);
+			if (!s) {
+				fprintf(stderr, "myfs_state_create failed\n");
+				exit(1);
+			}
+			s->log_mode = MYFS_LOG_DELTA;
+			s->alloc_policy = (enum myfs_alloc_policy)p;
+			for (f = 0; f < files; f++) {
+				snprintf(path, sizeof(path), "/f%d", f);
+				myfs_file_create(s, path, 0644);
+			}
+			alloc_bench_state = s;
+			t0 = now_ns();
+			for (t = 0; t < threads[n]; t++)
+				pthread_create(&tid[t], NULL, alloc_bench_worker, (void *)(uintptr_t)t);
+			for (t = 0; t < threads[n]; t++)
+				pthread_join(tid[t], NULL);
+			t1 = now_ns();
+			extents = 0;
+			mapped = 0;
+			for (f = 0; f < files; f++) {
+				extents += s->inodes[f].num_extents;
+				mapped += inode_mapped_blocks(&s->inodes[f], 0, ALLOC_BENCH_BLOCKS);
+			}
+			printf("%8s %8d %12.0f %14.2f %14.2f\n", policies[p], threads[n],
+			       (double)threads[n] * ALLOC_BENCH_OPS / ((t1 - t0) / 1e9),
+			       (double)extents / files, extents ? (double)mapped / extents : 0.0);
+			myfs_state_destroy(s);
+		}
+	}
+}
+
+/*
+ * Cloning a file with copy_file_range: an aligned clone shares the source's
+ * blocks, one starting a byte in copies them; then one 4 KB overwrite of
+ * the clone, which copies the block it lands in.
+ */
+static void bench_clone(void)
+{
+	const int bs = 4096, max_blocks = 16384;
+	static const int sizes[] = { 256, 2048, 16384 };
+	struct myfs_state *s;
+	char page[4096];
+	int i, shared, n, used;
+	double t0, t1, t2;
+	ssize_t res;
+
+	memset(page, 'c', sizeof(page));
+	printf("clone a file, then overwrite 4 KB of the clone\n");
+	printf("%8s %8s %12s %12s %14s\n", "MB", "aligned", "us/clone", "blocks used", "us/overwrite");
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		for (shared = 1; shared >= 0; shared--) {
+			n = sizes[i];
+			s = myfs_state_create(NULL, ".", NULL, 2, 2 * max_blocks + 2, bs, 0);
+			if (!s || myfs_file_create(s, "/src", 0644) != 0 ||
+			    myfs_file_create(s, "/dst", 0644) != 1 ||
+			    myfs_file_fallocate(s, 0, 0, (off_t)n * bs + 1, 0) != 0) {
+				fprintf(stderr, "myfs_state_create failed\n");
+				exit(1);
+			}
+			used = s->data_block_bitmap.nfree;
+			t0 = now_ns();
+			res = myfs_file_clone(s, 0, shared ? 0 : 1, 1, 0, (size_t)n * bs);
+			t1 = now_ns();
+			if (res != (ssize_t)n * bs ||
+			    inode_write(s, &s->inodes[1], page, sizeof(page), (off_t)(n / 2) * bs) < 0) {
+				fprintf(stderr, "clone failed\n");
+				exit(1);
+			}
+			t2 = now_ns();
+			used -= s->data_block_bitmap.nfree;
+			printf("%8d %8s %12.1f %12d %14.1f\n", n * bs >> 20, shared ? "yes" : "no",
+			       (t1 - t0) / 1e3, used, (t2 - t1) / 1e3);
+			myfs_state_destroy(s);
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{ "path", bench_path },
+	{ "bitmap", bench_bitmap },
+	{ "create", bench_create },
+	{ "mount", bench_mount },
+	{ "read", bench_read },
+	{ "seqread", bench_seqread },
+	{ "overwrite", bench_overwrite },
+	{ "journal", bench_journal },
+	{ "tiny", bench_tiny },
+	{ "readdir", bench_readdir },
+	{ "rename", bench_rename },
+	{ "truncate", bench_truncate },
+	{ "fallocate", bench_fallocate },
+	{ "delalloc", bench_delalloc },
+	{ "alloc", bench_alloc },
+	{ "clone", bench_clone },
+};
+
+int main(int argc, char *argv[])
+{
+	size_t b;
+	int i, found;
+
+	for (b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+		found = argc < 2;
+		for (i = 1; i < argc; i++)
+			found |= strcmp(argv[i], benchmarks[b].name) == 0;
+		if (found)
+			benchmarks[b].run();
+	}
+	return 0;
+}
@@ -0,0 +1,409 @@
+/*
+  Crash test for journal replay.
+
+  A child process builds a volume image with the journal on: it writes
+  files with holes, clones one and rewrites part of the clone (unsharing
+  its blocks), truncates, preallocates, renames a directory with files in
+  it, unlinks and reuses the freed inode and blocks. It then describes the
+  state it leaves and exits without a checkpoint, as a crash would. The
+  parent mounts the image again, which replays the journal, and the
+  bitmaps, sizes, block maps, paths and file contents must match what the
+  child described, and again after a clean unmount and remount.
+
+  With checkpoint set, the child runs image_sync partway through, so that
+  replay starts from a checkpoint instead of from an empty volume.
+
+  usage: myfs_replay image [checkpoint]
+*/
+
+#include "params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define NUM_INODES 16
+#define NUM_DATA_BLOCKS 256
+#define BLOCK_SIZE 64
+#define INLINE_SIZE 40
+#define MAX_FILE (NUM_DATA_BLOCKS * BLOCK_SIZE)
+
+static struct myfs_state *s;
+static int generation;		/* makes each write's bytes its own */
+static int failed;
+
+static void fail(const char *what, const char *path)
+{
+	fprintf(stderr, "myfs_replay: %s (%s)\n", what, path);
+	failed = 1;
+}
+
+/* Lock path's inode for a change; returns it, or -1 */
+static int file_lock(const char *path)
+{
+	int i;
+
+	myfs_op_begin(s, 0);
+	i = path_to_inode_lookup(s, path);
+	if (i < 0) {
+		fail("no such file", path);
+		myfs_op_end(s);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&s->inodes[i].lock);
+	return i;
+}
+
+static void file_unlock(int i)
+{
+	pthread_rwlock_unlock(&s->inodes[i].lock);
+	if (myfs_op_end(s) != 0)
+		fail("journal commit failed", "");
+}
+
+static void do_create(const char *path)
+{
+	myfs_op_begin(s, 1);
+	if (myfs_file_create(s, path, 0640) < 0)
+		fail("create failed", path);
+	if (myfs_op_end(s) != 0)
+		fail("journal commit failed", path);
+}
+
+/* Write len bytes at off, growing the size as write does */
+static void do_write(const char *path, off_t off, size_t len)
+{
+	char buf[MAX_FILE];
+	struct inode *ino;
+	size_t k;
+	int i = file_lock(path);
+
+	if (i < 0)
+		return;
+	ino = &s->inodes[i];
+	generation++;
+	for (k = 0; k < len; k++)
+		buf[k] = (char)(generation * 31 + (off + (off_t)k) * 7 + 1);
+	if (inode_write(s, ino, buf, len, off) != (ssize_t)len)
+		fail("write failed", path);
+	else if (off + (off_t)len > ino->size) {
+		ino->size = off + (off_t)len;
+		journal_note(s, JOURNAL_SIZE, i, ino->size, 0, NULL);
+	}
+	file_unlock(i);
+}
+
+static void do_truncate(const char *path, off_t size)
+{
+	int i = file_lock(path);
+
+	if (i < 0)
+		return;
+	if (myfs_file_truncate(s, i, size) != 0)
+		fail("truncate failed", path);
+	file_unlock(i);
+}
+
+static void do_fallocate(const char *path, off_t off, off_t len, int keep_size)
+{
+	int i = file_lock(path);
+
+	if (i < 0)
+		return;
+	if (myfs_file_fallocate(s, i, off, len, keep_size) != 0)
+		fail("fallocate failed", path);
+	file_unlock(i);
+}
+
+/* Copy all of from into the empty file to, sharing whole blocks */
+static void do_clone(const char *from, const char *to)
+{
+	struct inode *first, *second;
+	int i, j;
+
+	myfs_op_begin(s, 0);
+	i = path_to_inode_lookup(s, from);
+	j = path_to_inode_lookup(s, to);
+	if (i < 0 || j < 0 || i == j) {
+		fail("nothing to clone", to);
+		myfs_op_end(s);
+		return;
+	}
+	first = &s->inodes[i < j ? i : j];
+	second = &s->inodes[i < j ? j : i];
+	pthread_rwlock_wrlock(&first->lock);
+	pthread_rwlock_wrlock(&second->lock);
+	if (myfs_file_clone(s, i, 0, j, 0, (size_t)s->inodes[i].size) != s->inodes[i].size)
+		fail("clone failed", to);
+	if (!s->inodes[j].shared)
+		fail("clone shares no blocks", to);
+	pthread_rwlock_unlock(&second->lock);
+	pthread_rwlock_unlock(&first->lock);
+	if (myfs_op_end(s) != 0)
+		fail("journal commit failed", to);
+}
+
+static void do_rename(const char *from, const char *to)
+{
+	myfs_op_begin(s, 1);
+	if (myfs_path_rename(s, from, to, 0) != 0)
+		fail("rename failed", from);
+	if (myfs_op_end(s) != 0)
+		fail("journal commit failed", from);
+}
+
+static void do_unlink(const char *path)
+{
+	myfs_op_begin(s, 1);
+	if (myfs_file_unlink(s, path) < 0)
+		fail("unlink failed", path);
+	if (myfs_op_end(s) != 0)
+		fail("journal commit failed", path);
+}
+
+static void do_checkpoint(void)
+{
+	myfs_op_begin(s, 1);
+	if (image_sync(s, 0) != 0)
+		fail("checkpoint failed", "");
+	myfs_op_end(s);
+}
+
+/* The operations the image goes through before the crash */
+static void run_ops(int checkpoint)
+{
+	do_create("/dir/a");
+	do_create("/dir/b");
+	do_create("/c");
+	do_create("/d");
+	do_create("/e");
+	do_create("/small");
+	do_write("/dir/a", 0, 300);
+	do_write("/dir/a", 1000, 100);		/* leaves a hole */
+	do_write("/c", 0, 500);
+	do_write("/small", 0, 20);		/* stays inline */
+	do_clone("/dir/a", "/dir/b");
+	do_write("/dir/b", 70, 40);		/* unshares one block */
+	if (checkpoint)
+		do_checkpoint();
+	do_write("/small", 20, 60);		/* promoted to a block */
+	do_truncate("/c", 130);
+	do_truncate("/c", 900);			/* grows as a hole */
+	do_fallocate("/d", 0, 256, 0);
+	do_write("/e", 0, 10);
+	do_fallocate("/e", 64, 200, 1);		/* blocks past the end */
+	do_write("/e", 64, 30);
+	do_rename("/dir", "/moved");
+	do_unlink("/d");
+	do_create("/moved/f");			/* takes /d's inode and blocks */
+	do_write("/moved/f", 0, 200);
+}
+
+static uint64_t fnv(const char *p, size_t n)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (n--)
+		h = (h ^ (unsigned char)*p++) * 1099511628211ull;
+	return h;
+}
+
+static int line_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* The state as text: bitmaps and the blocks with sharers, then per
+ * allocated inode its size, mode, block runs and a hash of its bytes,
+ * then the paths, sorted */
+static char *describe(void)
+{
+	static char buf[MAX_FILE];
+	char path[PATH_MAX], *lines[NUM_INODES], *out = NULL;
+	const struct extent *e;
+	const struct inode *ino;
+	size_t len = 0;
+	FILE *f = open_memstream(&out, &len);
+	int i, j, n, run, start, logical;
+
+	if (!f)
+		return NULL;
+	fprintf(f, "inodes ");
+	for (i = 0; i < NUM_INODES; i++)
+		fputc('0' + bitmap_test(&s->inode_bitmap, i), f);
+	fprintf(f, "\nblocks ");
+	for (i = 0; i < NUM_DATA_BLOCKS; i++)
+		fputc('0' + bitmap_test(&s->data_block_bitmap, i), f);
+	fprintf(f, "\nshared");
+	for (i = 0; s->block_refs && i < NUM_DATA_BLOCKS; i++)
+		if (s->block_refs[i] > 0)
+			fprintf(f, " %d:%d", i, (int)s->block_refs[i]);
+	fputc('\n', f);
+	for (i = 0; i < NUM_INODES; i++) {
+		ino = &s->inodes[i];
+		if (!bitmap_test(&s->inode_bitmap, i))
+			continue;
+		if (inode_read(s, ino, ino->size, buf, (size_t)ino->size, 0) != (size_t)ino->size)
+			fail("short read", "");
+		fprintf(f, "inode %d size %lld mode %o data %016llx blocks", i, (long long)ino->size,
+			(unsigned)ino->mode, (unsigned long long)fnv(buf, (size_t)ino->size));
+		/* runs, however the extents split them */
+		for (j = 0; j < ino->num_extents; j = n) {
+			e = &ino->extents[j];
+			logical = e->logical;
+			start = e->start;
+			run = e->length;
+			for (n = j + 1; n < ino->num_extents &&
+			     ino->extents[n].logical == logical + run &&
+			     ino->extents[n].start == start + run; n++)
+				run += ino->extents[n].length;
+			fprintf(f, " %d+%d@%d", logical, run, start);
+		}
+		fputc('\n', f);
+	}
+	for (n = 0; n < s->path_count; n++) {
+		if (dentry_path(s->path_to_inode[n].dentry, path, sizeof(path)) < 0 ||
+		    asprintf(&lines[n], "path %s %d\n", path, s->path_to_inode[n].inode) < 0)
+			lines[n] = NULL;
+	}
+	qsort(lines, (size_t)n, sizeof(*lines), line_cmp);
+	for (j = 0; j < n; j++) {
+		fputs(lines[j] ? lines[j] : "path ?\n", f);
+		free(lines[j]);
+	}
+	fclose(f);
+	return out;
+}
+
+static struct myfs_state *mount_image(const char *image)
+{
+	return myfs_state_create(NULL, "/", image, NUM_INODES, NUM_DATA_BLOCKS, BLOCK_SIZE,
+				 INLINE_SIZE);
+}
+
+/* Run the operations and crash, writing what they left to fd */
+static void child(const char *image, int checkpoint, int fd)
+{
+	char *want;
+	size_t len, done;
+	ssize_t n;
+
+	s = mount_image(image);
+	if (!s || journal_start(s, 0) != 0) {
+		fprintf(stderr, "myfs_replay: cannot open %s\n", image);
+		_exit(1);
+	}
+	run_ops(checkpoint);
+	want = describe();
+	if (!want || failed)
+		_exit(1);
+	len = strlen(want);
+	for (done = 0; done < len; done += (size_t)n) {
+		n = write(fd, want + done, len - done);
+		if (n <= 0)
+			_exit(1);
+	}
+	/* no image_sync, no unmount: only the journal and the mapping remain */
+	_exit(0);
+}
+
+/* Compare the state with what the child left, reporting the first
+ * difference */
+static void check(const char *want, const char *when)
+{
+	char *got = describe();
+	size_t k = 0, line;
+
+	if (!got) {
+		fail("cannot describe the state", when);
+		return;
+	}
+	while (want[k] && want[k] == got[k])
+		k++;
+	if (want[k] || got[k]) {
+		for (line = k; line > 0 && want[line - 1] != '\n'; line--)
+			;
+		fprintf(stderr, "myfs_replay: %s, want:\n%.*s\ngot:\n%.*s\n", when,
+			(int)strcspn(want + line, "\n"), want + line,
+			(int)strcspn(got + line, "\n"), got + line);
+		failed = 1;
+	}
+	free(got);
+}
+
+int main(int argc, char *argv[])
+{
+	char journal[PATH_MAX], *want = NULL;
+	size_t len = 0, cap = 0;
+	ssize_t n;
+	int fds[2], status, checkpoint = 0;
+	pid_t pid;
+
+	if (argc > 2)
+		checkpoint = atoi(argv[2]);
+	if (argc < 2 || argc > 3 ||
+	    snprintf(journal, sizeof(journal), "%s.journal", argv[1]) >= (int)sizeof(journal)) {
+		fprintf(stderr, "usage: myfs_replay image [checkpoint]\n");
+		return 2;
+	}
+	unlink(argv[1]);
+	unlink(journal);
+
+	if (pipe(fds) != 0 || (pid = fork()) < 0) {
+		perror("myfs_replay");
+		return 1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		child(argv[1], checkpoint, fds[1]);
+	}
+	close(fds[1]);
+	for (;;) {
+		if (len + 4096 + 1 > cap) {
+			cap = 2 * cap + 4096 + 1;
+			want = (char *)realloc(want, cap);
+			if (!want)
+				return 1;
+		}
+		n = read(fds[0], want + len, cap - len - 1);
+		if (n <= 0)
+			break;
+		len += (size_t)n;
+	}
+	close(fds[0]);
+	want[len] = '\0';
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "myfs_replay: the operations before the crash failed\n");
+		free(want);
+		return 1;
+	}
+
+	s = mount_image(argv[1]);
+	if (!s) {
+		fprintf(stderr, "myfs_replay: replay failed\n");
+		free(want);
+		return 1;
+	}
+	check(want, "after replay");
+	if (image_sync(s, 1) != 0)
+		fail("unmount failed", argv[1]);
+	myfs_state_destroy(s);
+	s = mount_image(argv[1]);
+	if (s) {
+		check(want, "after a clean remount");
+		myfs_state_destroy(s);
+	} else {
+		fail("remount failed", argv[1]);
+	}
+
+	printf("myfs_replay: %s: %s\n", checkpoint ? "from a checkpoint" : "from an empty volume",
+	       failed ? "FAILED" : "ok");
+	free(want);
+	unlink(argv[1]);
+	unlink(journal);
+	return failed ? 1 : 0;
+}
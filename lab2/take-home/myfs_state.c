@@ -0,0 +1,1382 @@
+/*
+  myfs in-memory state: data blocks, inodes, bitmaps, the path index and
+  the directory tree.
+
+  Kept free of FUSE calls so the structures can be linked into the
+  benchmarks as well as the filesystem itself.
+*/
+
+#include "params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* --- data block arena --- */
+
+/*
+ * All block payloads live in one shared mapping of a memfd: mount does a
+ * single mmap instead of one malloc per block, pages are zero-filled lazily
+ * by the kernel, and adjacent blocks are adjacent in memory. The memfd lets
+ * reads hand block ranges to FUSE by file offset, for splicing. Without
+ * memfd_create the arena is plain anonymous memory. Large arenas ask for
+ * transparent huge pages.
+ */
+#define ARENA_HUGEPAGE_SIZE (2UL << 20)
+
+static char *block_arena_map(size_t size, int *fd)
+{
+	void *arena = MAP_FAILED;
+
+	*fd = -1;
+	if (size == 0)
+		return NULL;
+	*fd = memfd_create("myfs-blocks", MFD_CLOEXEC);
+	if (*fd >= 0 && ftruncate(*fd, (off_t)size) == 0)
+		arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, *fd, 0);
+	if (arena == MAP_FAILED) {
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+		arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (arena == MAP_FAILED)
+			return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if (size >= ARENA_HUGEPAGE_SIZE)
+		madvise(arena, size, MADV_HUGEPAGE);
+#endif
+	return (char *)arena;
+}
+
+/* --- locking --- */
+
+void myfs_op_begin(struct myfs_state *s, int ns_change)
+{
+	if (ns_change || s->log_mode == MYFS_LOG_FULL)
+		pthread_rwlock_wrlock(&s->ns_lock);
+	else
+		pthread_rwlock_rdlock(&s->ns_lock);
+}
+
+int myfs_op_end(struct myfs_state *s)
+{
+	pthread_rwlock_unlock(&s->ns_lock);
+	/* outside the lock, so concurrent operations can share one sync */
+	return journal_commit(s);
+}
+
+/* --- allocation with change tracking --- */
+
+/* Record a change for MYFS_LOG_DELTA, merging block runs as they grow;
+ * returns it, or NULL if nothing was recorded. The caller holds
+ * alloc_lock. */
+static struct myfs_change *change_note(struct myfs_state *s, char kind, char sign, int first,
+				       const char *path)
+{
+	struct myfs_change *c;
+	int max;
+
+	if (s->log_mode != MYFS_LOG_DELTA)
+		return NULL;
+	if (kind == 'B' && s->num_changes > 0) {
+		c = &s->changes[s->num_changes - 1];
+		if (c->kind == 'B' && c->sign == sign && c->last + 1 == first) {
+			c->last = first;
+			return c;
+		}
+	}
+	if (s->num_changes == s->max_changes) {
+		max = s->max_changes ? 2 * s->max_changes : 16;
+		c = (struct myfs_change *)realloc(s->changes, (size_t)max * sizeof(struct myfs_change));
+		if (!c)
+			return NULL;
+		s->changes = c;
+		s->max_changes = max;
+	}
+	c = &s->changes[s->num_changes++];
+	c->kind = kind;
+	c->sign = sign;
+	c->first = first;
+	c->last = first;
+	c->path = path ? strdup(path) : NULL;
+	c->to = NULL;
+	return c;
+}
+
+void myfs_inode_mark(struct myfs_state *s, int i, int allocated)
+{
+	if (allocated)
+		bitmap_set(&s->inode_bitmap, i);
+	else
+		bitmap_clear(&s->inode_bitmap, i);
+	change_note(s, 'I', allocated ? '+' : '-', i, NULL);
+}
+
+void myfs_block_mark(struct myfs_state *s, int b, int allocated)
+{
+	if (allocated)
+		bitmap_set(&s->data_block_bitmap, b);
+	else
+		bitmap_clear(&s->data_block_bitmap, b);
+	change_note(s, 'B', allocated ? '+' : '-', b, NULL);
+}
+
+void myfs_blocks_mark_free(struct myfs_state *s, int b, int n)
+{
+	struct myfs_change *c;
+
+	bitmap_clear_range(&s->data_block_bitmap, b, n);
+	c = change_note(s, 'B', '-', b, NULL);
+	if (c)
+		c->last = b + n - 1;
+}
+
+void myfs_changes_clear(struct myfs_state *s)
+{
+	int i;
+
+	for (i = 0; i < s->num_changes; i++) {
+		free(s->changes[i].path);
+		free(s->changes[i].to);
+	}
+	s->num_changes = 0;
+}
+
+/* --- allocation policies (--alloc); all under alloc_lock --- */
+
+static __thread int alloc_group = -1;	/* this thread's allocation group */
+
+static int group_size(const struct myfs_state *s)
+{
+	int size = (s->NUM_DATA_BLOCKS + MYFS_ALLOC_NGROUPS - 1) / MYFS_ALLOC_NGROUPS;
+
+	return size > 0 ? size : 1;
+}
+
+/* Where the calling thread's next fit starts: the cursor of its group
+ * (handed out round robin on its first allocation), kept inside it */
+static int group_cursor(struct myfs_state *s)
+{
+	int start, cursor;
+
+	if (alloc_group < 0)
+		alloc_group = s->alloc_next_group++ % MYFS_ALLOC_NGROUPS;
+	start = alloc_group * group_size(s);
+	cursor = s->alloc_group_cursor[alloc_group];
+	return cursor >= start && cursor < start + group_size(s) ? cursor : start;
+}
+
+/* Where next fit starts under the policy; 0 for the others */
+static int policy_cursor(struct myfs_state *s)
+{
+	switch (s->alloc_policy) {
+	case MYFS_ALLOC_NEXT:
+		return s->alloc_cursor;
+	case MYFS_ALLOC_GROUPS:
+		return group_cursor(s);
+	default:
+		return 0;
+	}
+}
+
+/* Start of a free run of n blocks the policy picks, or -1 if there is none */
+static int policy_find_run(struct myfs_state *s, int n)
+{
+	int b;
+
+	if (s->alloc_policy == MYFS_ALLOC_BEST)
+		return bitmap_find_best_run(&s->data_block_bitmap, n);
+	b = bitmap_find_zero_run(&s->data_block_bitmap, n, policy_cursor(s));
+	return b >= 0 ? b : bitmap_find_zero_run(&s->data_block_bitmap, n, 0);
+}
+
+/* A free block the policy picks; the caller made sure there is one */
+static int policy_find_block(struct myfs_state *s)
+{
+	int b = -1;
+
+	if (s->alloc_policy == MYFS_ALLOC_NEXT || s->alloc_policy == MYFS_ALLOC_GROUPS)
+		b = bitmap_find_next_zero(&s->data_block_bitmap, policy_cursor(s));
+	return b >= 0 ? b : bitmap_find_first_zero(&s->data_block_bitmap);
+}
+
+/* Block b was taken: next fit goes on after it, and a thread whose group
+ * filled up moves to the group it spilled into */
+static void policy_taken(struct myfs_state *s, int b)
+{
+	switch (s->alloc_policy) {
+	case MYFS_ALLOC_NEXT:
+		s->alloc_cursor = b + 1;
+		break;
+	case MYFS_ALLOC_GROUPS:
+		alloc_group = b / group_size(s);
+		s->alloc_group_cursor[alloc_group] = b + 1;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Map data blocks at every unmapped file block of [lblk, lblk + n), one
+ * at a time as the policy picks them, or with run (and always under
+ * MYFS_ALLOC_BEST) consecutive blocks of a free run the policy finds long
+ * enough for all of them (single blocks if there is none), zeroed if zero.
+ * held of the blocks come out of delalloc_held. */
+static int blocks_map(struct myfs_state *s, struct inode *ino, int lblk, int n, int run,
+		      int zero, int held)
+{
+	int l, b, need, first = -1, next = -1, extent = -1, extent_lblk = 0, extent_len = 0, res = 0;
+
+	need = n - inode_mapped_blocks(ino, lblk, n);
+	pthread_mutex_lock(&s->alloc_lock);
+	if (s->data_block_bitmap.nfree - (s->delalloc_held - held) < need) {
+		pthread_mutex_unlock(&s->alloc_lock);
+		return -ENOSPC;
+	}
+	s->delalloc_held -= held;
+	if ((run || s->alloc_policy == MYFS_ALLOC_BEST) && need > 0)
+		first = next = policy_find_run(s, need);
+	for (l = lblk; l < lblk + n; l++) {
+		if (inode_block_at(ino, l) >= 0)
+			continue;
+		b = next >= 0 ? next : policy_find_block(s);
+		if (inode_map_block(ino, l, b) != 0) {
+			res = -ENOMEM;
+			break;
+		}
+		myfs_block_mark(s, b, 1);
+		policy_taken(s, b);
+		if (next >= 0)
+			next++;
+		else if (zero)
+			memset(s->data_blocks[b].data, 0, (size_t)s->DATA_BLOCK_SIZE);
+		/* one journal record per run contiguous in the file and the volume */
+		if (extent_len > 0 && (extent + extent_len != b || extent_lblk + extent_len != l)) {
+			journal_note_blocks(s, ino->index, extent_lblk, extent, extent_len);
+			extent_len = 0;
+		}
+		if (extent_len++ == 0) {
+			extent = b;
+			extent_lblk = l;
+		}
+	}
+	if (extent_len > 0)
+		journal_note_blocks(s, ino->index, extent_lblk, extent, extent_len);
+	/* what was held for blocks left unmapped stays held */
+	if (res != 0)
+		s->delalloc_held += held;
+	pthread_mutex_unlock(&s->alloc_lock);
+	/* the run is ino's now: zero it without holding up other allocations */
+	if (zero && first >= 0)
+		memset(s->data_blocks[first].data, 0, (size_t)(next - first) * (size_t)s->DATA_BLOCK_SIZE);
+	return res;
+}
+
+int myfs_blocks_alloc(struct myfs_state *s, struct inode *ino, int lblk, int n)
+{
+	return blocks_map(s, ino, lblk, n, 0, 0, 0);
+}
+
+int myfs_blocks_reserve(struct myfs_state *s, struct inode *ino, int lblk, int n)
+{
+	return blocks_map(s, ino, lblk, n, 1, 1, 0);
+}
+
+int myfs_blocks_commit(struct myfs_state *s, struct inode *ino, int lblk, int n)
+{
+	return blocks_map(s, ino, lblk, n, 1, 0, n);
+}
+
+int myfs_blocks_hold(struct myfs_state *s, int n)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&s->alloc_lock);
+	if (n > 0 && s->data_block_bitmap.nfree - s->delalloc_held < n)
+		res = -ENOSPC;
+	else
+		s->delalloc_held += n;
+	pthread_mutex_unlock(&s->alloc_lock);
+	return res;
+}
+
+void myfs_blocks_truncate(struct myfs_state *s, struct inode *ino, int lblk)
+{
+	const struct extent *e;
+	int i, from;
+
+	pthread_mutex_lock(&s->alloc_lock);
+	for (i = ino->num_extents - 1; i >= 0; i--) {
+		e = &ino->extents[i];
+		if (e->logical + e->length <= lblk)
+			break;
+		from = e->logical < lblk ? lblk - e->logical : 0;
+		myfs_blocks_put(s, e->start + from, e->length - from, 1);
+	}
+	pthread_mutex_unlock(&s->alloc_lock);
+	inode_unmap_from(ino, lblk);
+	if (ino->num_blocks == 0)
+		ino->shared = 0;
+}
+
+void myfs_blocks_free(struct myfs_state *s, struct inode *ino)
+{
+	myfs_blocks_truncate(s, ino, 0);
+}
+
+/* --- shared blocks (copy-on-write clones) --- */
+
+/*
+ * A clone maps the source's data blocks into the destination instead of
+ * copying them, and block_refs counts the extra mappings. Freeing a shared
+ * block only drops a count. A write to a file marked shared first gives it
+ * a copy of each shared block in the range, so a block is copied only once
+ * one of its sharers changes it. The counts are not stored in the image:
+ * mount works them out again from the block maps.
+ */
+
+static void blocks_free_range(struct myfs_state *s, int b, int n, int note)
+{
+	if (note)
+		myfs_blocks_mark_free(s, b, n);
+	else
+		bitmap_clear_range(&s->data_block_bitmap, b, n);
+}
+
+void myfs_blocks_put(struct myfs_state *s, int b, int n, int note)
+{
+	int i, run = b;
+
+	/* the runs between shared blocks go one range at a time */
+	for (i = b; s->block_refs && i < b + n; i++) {
+		if (s->block_refs[i] == 0)
+			continue;
+		s->block_refs[i]--;
+		if (i > run)
+			blocks_free_range(s, run, i - run, note);
+		run = i + 1;
+	}
+	if (b + n > run)
+		blocks_free_range(s, run, b + n - run, note);
+}
+
+static int refs_alloc(struct myfs_state *s)
+{
+	if (!s->block_refs)
+		s->block_refs = (uint16_t *)calloc((size_t)s->NUM_DATA_BLOCKS, sizeof(uint16_t));
+	return s->block_refs ? 0 : -ENOMEM;
+}
+
+int myfs_block_ref(struct myfs_state *s, int b)
+{
+	if (refs_alloc(s) != 0)
+		return -ENOMEM;
+	if (s->block_refs[b] == UINT16_MAX)
+		return -EMLINK;
+	s->block_refs[b]++;
+	return 0;
+}
+
+int myfs_blocks_share(struct myfs_state *s, struct inode *src, int lblk, struct inode *dst,
+		      int dst_lblk, int n)
+{
+	const struct extent *e;
+	struct extent *pieces;
+	int i, k, lo, hi, b, count = 0, res = 0;
+
+	/* the pieces of src in range, where they go in dst (src may be dst) */
+	for (i = inode_extent_after(src, lblk);
+	     i < src->num_extents && src->extents[i].logical < lblk + n; i++)
+		count++;
+	if (count == 0)
+		return 0;
+	pieces = (struct extent *)malloc((size_t)count * sizeof(struct extent));
+	if (!pieces || inode_reserve_extents(dst, dst->num_extents + count) != 0) {
+		free(pieces);
+		return -ENOMEM;
+	}
+	for (i = inode_extent_after(src, lblk), k = 0; k < count; i++, k++) {
+		e = &src->extents[i];
+		lo = e->logical > lblk ? e->logical : lblk;
+		hi = e->logical + e->length < lblk + n ? e->logical + e->length : lblk + n;
+		pieces[k].logical = dst_lblk + (lo - lblk);
+		pieces[k].start = e->start + (lo - e->logical);
+		pieces[k].length = hi - lo;
+	}
+
+	pthread_mutex_lock(&s->alloc_lock);
+	res = refs_alloc(s);
+	/* every block must take another sharer before any is shared */
+	for (k = 0; res == 0 && k < count; k++)
+		for (b = pieces[k].start; b < pieces[k].start + pieces[k].length; b++)
+			if (s->block_refs[b] == UINT16_MAX)
+				res = -EMLINK;
+	for (k = 0; res == 0 && k < count; k++) {
+		for (b = pieces[k].start; b < pieces[k].start + pieces[k].length; b++)
+			s->block_refs[b]++;
+		inode_map_extent(dst, pieces[k].logical, pieces[k].start, pieces[k].length);
+		journal_note_blocks(s, dst->index, pieces[k].logical, pieces[k].start,
+				    pieces[k].length);
+	}
+	pthread_mutex_unlock(&s->alloc_lock);
+	free(pieces);
+	if (res == 0) {
+		src->shared = 1;
+		dst->shared = 1;
+	}
+	return res;
+}
+
+int myfs_blocks_unshare(struct myfs_state *s, struct inode *ino, int lblk, int n)
+{
+	int l, b, copy, res = 0;
+
+	if (!ino->shared)
+		return 0;
+	pthread_mutex_lock(&s->alloc_lock);
+	for (l = lblk; l < lblk + n; l++) {
+		b = inode_block_at(ino, l);
+		if (b < 0 || s->block_refs[b] == 0)
+			continue;
+		if (s->data_block_bitmap.nfree - s->delalloc_held < 1) {
+			res = -ENOSPC;
+			break;
+		}
+		copy = policy_find_block(s);
+		if (inode_remap_block(ino, l, copy) != 0) {
+			res = -ENOMEM;
+			break;
+		}
+		/* copied before b loses this sharer, while no one can free it */
+		memcpy(s->data_blocks[copy].data, s->data_blocks[b].data, (size_t)s->DATA_BLOCK_SIZE);
+		myfs_block_mark(s, copy, 1);
+		policy_taken(s, copy);
+		s->block_refs[b]--;
+		journal_note_blocks(s, ino->index, l, copy, 1);
+	}
+	pthread_mutex_unlock(&s->alloc_lock);
+	return res;
+}
+
+int myfs_blocks_room(struct myfs_state *s, const struct inode *ino, int lblk, int n)
+{
+	int l, b, need, res = 0;
+
+	need = n - inode_mapped_blocks(ino, lblk, n);
+	if (need == 0 && !ino->shared)
+		return 0;
+	pthread_mutex_lock(&s->alloc_lock);
+	for (l = lblk; ino->shared && l < lblk + n; l++) {
+		b = inode_block_at(ino, l);
+		if (b >= 0 && s->block_refs[b] > 0)
+			need++;
+	}
+	if (s->data_block_bitmap.nfree - s->delalloc_held < need)
+		res = -ENOSPC;
+	pthread_mutex_unlock(&s->alloc_lock);
+	return res;
+}
+
+static int extent_start_cmp(const void *a, const void *b)
+{
+	const struct extent *x = (const struct extent *)a, *y = (const struct extent *)b;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+int myfs_blocks_count_refs(struct myfs_state *s)
+{
+	struct extent *all;
+	struct inode *ino;
+	struct bitmap seen;
+	int i, j, b, n = 0, end = 0, shared = 0, res = 0;
+
+	free(s->block_refs);
+	s->block_refs = NULL;
+	for (i = 0; i < s->NUM_INODES; i++) {
+		s->inodes[i].shared = 0;
+		n += s->inodes[i].num_extents;
+	}
+	/* block maps that overlap nowhere share nothing */
+	all = (struct extent *)malloc((size_t)(n > 0 ? n : 1) * sizeof(struct extent));
+	if (!all)
+		return -1;
+	for (i = 0, n = 0; i < s->NUM_INODES; i++)
+		for (j = 0; j < s->inodes[i].num_extents; j++)
+			all[n++] = s->inodes[i].extents[j];
+	qsort(all, (size_t)n, sizeof(*all), extent_start_cmp);
+	for (i = 0; i < n && !shared; i++) {
+		shared = all[i].start < end;
+		if (all[i].start + all[i].length > end)
+			end = all[i].start + all[i].length;
+	}
+	free(all);
+	if (!shared)
+		return 0;
+
+	if (refs_alloc(s) != 0 || bitmap_init(&seen, s->NUM_DATA_BLOCKS) != 0)
+		return -1;
+	for (i = 0; i < s->NUM_INODES && res == 0; i++) {
+		ino = &s->inodes[i];
+		for (j = 0; j < ino->num_extents && res == 0; j++) {
+			for (b = ino->extents[j].start; b < ino->extents[j].start + ino->extents[j].length; b++) {
+				if (!bitmap_test(&seen, b)) {
+					bitmap_set(&seen, b);
+				} else if (s->block_refs[b] == UINT16_MAX) {
+					res = -1;
+					break;
+				} else {
+					s->block_refs[b]++;
+				}
+			}
+		}
+	}
+	/* every inode mapping a block mapped more than once shares it */
+	for (i = 0; i < s->NUM_INODES && res == 0; i++) {
+		ino = &s->inodes[i];
+		for (j = 0; j < ino->num_extents && !ino->shared; j++)
+			for (b = ino->extents[j].start; b < ino->extents[j].start + ino->extents[j].length; b++)
+				if (s->block_refs[b] > 0)
+					ino->shared = 1;
+	}
+	bitmap_free(&seen);
+	return res;
+}
+
+/* --- directory tree --- */
+
+/*
+ * Every tracked file and every directory has a dentry. A directory's
+ * children sit in a table of its own (linear probing, kept at most half
+ * full by doubling), so listing it visits only its entries and a lookup
+ * costs one probe per path component. Images and journals record file
+ * paths only, so adding a path makes the directories missing on the way.
+ */
+#define DENTRY_MIN_SLOTS 8
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+
+	while (len--) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct dentry *dentry_new(const char *name, size_t len, int inode)
+{
+	struct dentry *d = (struct dentry *)calloc(1, sizeof(struct dentry));
+
+	if (!d)
+		return NULL;
+	d->name = strndup(name, len);
+	d->hash = name_hash(name, len);
+	d->inode = inode;
+	if (inode < 0) {
+		d->child_mask = DENTRY_MIN_SLOTS - 1;
+		d->children = (struct dentry **)calloc(DENTRY_MIN_SLOTS, sizeof(struct dentry *));
+	}
+	if (!d->name || (inode < 0 && !d->children)) {
+		free(d->name);
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+/* Free d and everything under it */
+static void dentry_free(struct dentry *d)
+{
+	unsigned i;
+
+	if (!d)
+		return;
+	for (i = 0; d->children && i <= d->child_mask; i++)
+		dentry_free(d->children[i]);
+	free(d->children);
+	free(d->name);
+	free(d);
+}
+
+/* Slot of name in dir's table, or the empty slot ending its probe run */
+static unsigned dentry_slot(const struct dentry *dir, const char *name, size_t len,
+			    uint32_t hash)
+{
+	unsigned i = hash & dir->child_mask;
+	const struct dentry *c;
+
+	while ((c = dir->children[i]) != NULL) {
+		if (c->hash == hash && strncmp(c->name, name, len) == 0 && c->name[len] == '\0')
+			break;
+		i = (i + 1) & dir->child_mask;
+	}
+	return i;
+}
+
+/* Double dir's table if one more child would take it past half full;
+ * returns 0 or -1 if out of memory */
+static int dentry_make_room(struct dentry *dir)
+{
+	struct dentry **old = dir->children, **table;
+	unsigned mask = dir->child_mask, i, j;
+
+	if (2 * ((unsigned)dir->nchildren + 1) <= mask + 1)
+		return 0;
+	mask = 2 * mask + 1;
+	table = (struct dentry **)calloc((size_t)mask + 1, sizeof(struct dentry *));
+	if (!table)
+		return -1;
+	for (i = 0; i <= dir->child_mask; i++) {
+		if (!old[i])
+			continue;
+		for (j = old[i]->hash & mask; table[j]; j = (j + 1) & mask)
+			;
+		table[j] = old[i];
+	}
+	free(old);
+	dir->children = table;
+	dir->child_mask = mask;
+	return 0;
+}
+
+/* Put child in dir's table */
+static int dentry_link(struct dentry *dir, struct dentry *child)
+{
+	unsigned i;
+
+	if (dentry_make_room(dir) != 0)
+		return -1;
+	for (i = child->hash & dir->child_mask; dir->children[i]; i = (i + 1) & dir->child_mask)
+		;
+	dir->children[i] = child;
+	dir->nchildren++;
+	child->parent = dir;
+	return 0;
+}
+
+/* Follow path down the tree as far as it exists; returns the last dentry
+ * reached and points *rest at the components left ("" if all resolved) */
+static struct dentry *dentry_walk(struct dentry *d, const char **rest)
+{
+	const char *p = *rest;
+	struct dentry *c;
+	size_t len;
+	uint32_t h;
+
+	for (;;) {
+		while (*p == '/')
+			p++;
+		/* name_hash and the component's length in one pass */
+		h = 2166136261u;
+		for (len = 0; p[len] && p[len] != '/'; len++) {
+			h ^= (unsigned char)p[len];
+			h *= 16777619u;
+		}
+		if (len == 0 || !d->children)
+			break;
+		c = d->children[dentry_slot(d, p, len, h)];
+		if (!c)
+			break;
+		d = c;
+		p += len;
+	}
+	*rest = p;
+	return d;
+}
+
+struct dentry *dentry_lookup(struct myfs_state *s, const char *path)
+{
+	struct dentry *d = dentry_walk(s->root, &path);
+
+	return *path ? NULL : d;
+}
+
+struct dentry *dentry_add(struct myfs_state *s, const char *path, int inode)
+{
+	struct dentry *d = dentry_walk(s->root, &path), *c;
+	size_t len;
+	int last;
+
+	if (!*path) {
+		if ((d->inode < 0) != (inode < 0))
+			return NULL;
+		d->inode = inode;
+		return d;
+	}
+	if (!d->children)
+		return NULL;
+	for (;;) {
+		len = strcspn(path, "/");
+		last = path[len + strspn(path + len, "/")] == '\0';
+		c = dentry_new(path, len, last ? inode : -1);
+		if (!c || dentry_link(d, c) != 0) {
+			dentry_free(c);
+			return NULL;
+		}
+		if (last)
+			return c;
+		d = c;
+		path += len + strspn(path + len, "/");
+	}
+}
+
+int dentry_check_file(struct myfs_state *s, const char *path)
+{
+	const struct dentry *d = dentry_walk(s->root, &path);
+
+	if (!*path)
+		return d->inode < 0 ? -EISDIR : 0;
+	return d->children ? 0 : -ENOTDIR;
+}
+
+/* Empty slot i of dir's table, shifting later members of its probe run
+ * back into the hole */
+static void dentry_slot_delete(struct dentry *dir, unsigned i)
+{
+	unsigned j = i, home;
+
+	for (;;) {
+		dir->children[i] = NULL;
+		for (;;) {
+			j = (j + 1) & dir->child_mask;
+			if (!dir->children[j])
+				return;
+			home = dir->children[j]->hash & dir->child_mask;
+			/* move j into i unless its home lies cyclically in (i, j] */
+			if (i <= j ? (i >= home || home > j) : (i >= home && home > j))
+				break;
+		}
+		dir->children[i] = dir->children[j];
+		i = j;
+	}
+}
+
+/* Take d out of its parent's table, keeping it and its children */
+static void dentry_unlink(struct dentry *d)
+{
+	struct dentry *dir = d->parent;
+
+	dentry_slot_delete(dir, dentry_slot(dir, d->name, strlen(d->name), d->hash));
+	dir->nchildren--;
+	d->parent = NULL;
+}
+
+void dentry_remove(struct dentry *d)
+{
+	dentry_unlink(d);
+	dentry_free(d);
+}
+
+int dentry_path(const struct dentry *d, char *buf, size_t size)
+{
+	const struct dentry *p;
+	size_t len = 0, n;
+
+	for (p = d; p->parent; p = p->parent)
+		len += 1 + strlen(p->name);
+	if (len == 0)
+		len = 1;
+	if (len >= size)
+		return -1;
+	buf[len] = '\0';
+	buf[0] = '/';
+	for (p = d, n = len; p->parent; p = p->parent) {
+		n -= strlen(p->name);
+		memcpy(buf + n, p->name, strlen(p->name));
+		buf[--n] = '/';
+	}
+	return (int)len;
+}
+
+struct dentry *dentry_next_child(const struct dentry *dir, unsigned *pos)
+{
+	struct dentry *c;
+
+	for (; dir->children && *pos <= dir->child_mask; (*pos)++) {
+		c = dir->children[*pos];
+		if (c) {
+			(*pos)++;
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/* --- path_to_inode helpers --- */
+
+/*
+ * path_to_inode is a dense array of the tracked files (what
+ * log_fuse_context and image_sync walk), each pointing at its dentry and
+ * known to it by index, so removal swaps the last entry into the hole.
+ * Lookups walk the tree a component at a time.
+ */
+int path_to_inode_add(struct myfs_state *s, const char *path, int inode_index)
+{
+	struct dentry *d = dentry_lookup(s, path);
+
+	if (d && d->inode >= 0) {
+		d->inode = inode_index;
+		s->path_to_inode[d->index].inode = inode_index;
+	} else {
+		if (s->path_count >= s->NUM_INODES)
+			return -ENOSPC;
+		d = dentry_add(s, path, inode_index);
+		if (!d)
+			return -ENOMEM;
+		d->index = s->path_count;
+		s->path_to_inode[s->path_count].dentry = d;
+		s->path_to_inode[s->path_count].inode = inode_index;
+		s->path_count++;
+	}
+	pthread_mutex_lock(&s->alloc_lock);
+	change_note(s, 'P', '+', inode_index, path);
+	pthread_mutex_unlock(&s->alloc_lock);
+	return 0;
+}
+
+void path_to_inode_remove(struct myfs_state *s, const char *path)
+{
+	struct dentry *d = dentry_lookup(s, path);
+	int i, last = s->path_count - 1;
+
+	if (!d || d->inode < 0)
+		return;
+	i = d->index;
+	pthread_mutex_lock(&s->alloc_lock);
+	change_note(s, 'P', '-', d->inode, path);
+	pthread_mutex_unlock(&s->alloc_lock);
+	if (i != last) {
+		s->path_to_inode[i] = s->path_to_inode[last];
+		s->path_to_inode[i].dentry->index = i;
+	}
+	s->path_count--;
+	dentry_remove(d);
+}
+
+int path_to_inode_lookup(struct myfs_state *s, const char *path)
+{
+	const struct dentry *d = dentry_lookup(s, path);
+
+	return d ? d->inode : -1;
+}
+
+/* --- files --- */
+
+int myfs_file_create(struct myfs_state *s, const char *path, mode_t mode)
+{
+	int res, i = dentry_check_file(s, path);
+
+	if (i < 0)
+		return i;
+	pthread_mutex_lock(&s->alloc_lock);
+	i = bitmap_find_first_zero(&s->inode_bitmap);
+	if (i < 0) {
+		pthread_mutex_unlock(&s->alloc_lock);
+		return -ENOSPC;
+	}
+	myfs_inode_mark(s, i, 1);
+	pthread_mutex_unlock(&s->alloc_lock);
+
+	/* blocks come with the first write; until then the file is empty */
+	inode_clear_blocks(&s->inodes[i]);
+	s->inodes[i].size = 0;
+	s->inodes[i].flushed = 0;
+	s->inodes[i].mode = S_IFREG | (mode & 07777);
+	inode_touch(&s->inodes[i], 1);
+	/* journal replay frees inodes without clearing their inline bytes */
+	if (s->inline_size)
+		memset(inode_inline_data(s, &s->inodes[i]), 0, (size_t)s->inline_size);
+	/* no path, no file: give the inode back before the journal sees it */
+	res = path_to_inode_add(s, path, i);
+	if (res != 0) {
+		pthread_mutex_lock(&s->alloc_lock);
+		myfs_inode_mark(s, i, 0);
+		pthread_mutex_unlock(&s->alloc_lock);
+		return res;
+	}
+	journal_note(s, JOURNAL_CREATE, i, mode & 07777, 0, path);
+	return i;
+}
+
+int myfs_file_unlink(struct myfs_state *s, const char *path)
+{
+	int i = path_to_inode_lookup(s, path);
+
+	if (i < 0)
+		return -ENOENT;
+	journal_note(s, JOURNAL_UNLINK, i, 0, 0, path);
+	inode_drop_pending(s, &s->inodes[i]);
+	myfs_blocks_free(s, &s->inodes[i]);
+	s->inodes[i].size = 0;
+	s->inodes[i].flushed = 0;
+	pthread_mutex_lock(&s->alloc_lock);
+	myfs_inode_mark(s, i, 0);
+	pthread_mutex_unlock(&s->alloc_lock);
+	path_to_inode_remove(s, path);
+	return i;
+}
+
+int myfs_dir_create(struct myfs_state *s, const char *path)
+{
+	const char *rest = path;
+	struct dentry *d = dentry_walk(s->root, &rest);
+
+	if (!*rest)
+		return -EEXIST;
+	if (!d->children)
+		return -ENOTDIR;
+	return dentry_add(s, path, -1) ? 0 : -ENOMEM;
+}
+
+int myfs_dir_remove(struct myfs_state *s, const char *path)
+{
+	struct dentry *d = dentry_lookup(s, path);
+
+	if (!d)
+		return -ENOENT;
+	if (d->inode >= 0)
+		return -ENOTDIR;
+	if (d == s->root)
+		return -EBUSY;
+	if (d->nchildren)
+		return -ENOTEMPTY;
+	dentry_remove(d);
+	return 0;
+}
+
+int myfs_path_rename_prepare(struct myfs_state *s, const char *from, const char *to,
+			     int noreplace, struct myfs_rename *r)
+{
+	struct dentry *d = dentry_lookup(s, from), *dir, *old, *p;
+	const char *name = to;
+	size_t len;
+	char *copy;
+
+	memset(r, 0, sizeof(*r));
+	if (!d)
+		return -ENOENT;
+	if (d == s->root)
+		return -EBUSY;
+	old = dentry_walk(s->root, &name);
+	if (*name) {
+		/* to is new: its parent must exist */
+		len = strcspn(name, "/");
+		if (!old->children)
+			return -ENOTDIR;
+		if (name[len + strspn(name + len, "/")] != '\0')
+			return -ENOENT;
+		dir = old;
+		old = NULL;
+	} else {
+		if (old == s->root)
+			return -EBUSY;
+		dir = old->parent;
+		name = old->name;
+		len = strlen(name);
+	}
+	for (p = dir; p; p = p->parent) {
+		if (p == d)
+			return -EINVAL;
+	}
+	/* a rename onto itself leaves r empty: nothing to do */
+	if (old == d)
+		return 0;
+	if (old) {
+		if (noreplace)
+			return -EEXIST;
+		if (d->inode < 0 && old->inode >= 0)
+			return -ENOTDIR;
+		if (d->inode >= 0 && old->inode < 0)
+			return -EISDIR;
+		if (old->nchildren)
+			return -ENOTEMPTY;
+	}
+	copy = strndup(name, len);
+	if (!copy || dentry_make_room(dir) != 0) {
+		free(copy);
+		return -ENOMEM;
+	}
+	r->d = d;
+	r->dir = dir;
+	r->old = old;
+	r->name = copy;
+	r->len = len;
+	return 0;
+}
+
+void myfs_path_rename_commit(struct myfs_state *s, const char *from, const char *to,
+			     struct myfs_rename *r)
+{
+	struct dentry *d = r->d;
+	struct myfs_change *c;
+
+	if (!d)
+		return;
+	/* a file being replaced goes first, with its own records */
+	if (r->old && r->old->inode >= 0)
+		myfs_file_unlink(s, to);
+	else if (r->old)
+		dentry_remove(r->old);
+	journal_note_rename(s, from, to);
+	pthread_mutex_lock(&s->alloc_lock);
+	c = change_note(s, 'R', '+', d->inode, from);
+	if (c)
+		c->to = strdup(to);
+	pthread_mutex_unlock(&s->alloc_lock);
+
+	/* dentry_link finds the room prepare made */
+	dentry_unlink(d);
+	free(d->name);
+	d->name = r->name;
+	d->hash = name_hash(r->name, r->len);
+	dentry_link(r->dir, d);
+	r->d = NULL;
+	r->name = NULL;
+}
+
+void myfs_path_rename_cancel(struct myfs_rename *r)
+{
+	free(r->name);
+	r->d = NULL;
+	r->name = NULL;
+}
+
+int myfs_path_rename(struct myfs_state *s, const char *from, const char *to, int noreplace)
+{
+	struct myfs_rename r;
+	int res = myfs_path_rename_prepare(s, from, to, noreplace, &r);
+
+	if (res == 0)
+		myfs_path_rename_commit(s, from, to, &r);
+	return res;
+}
+
+int myfs_file_truncate(struct myfs_state *s, int i, off_t size)
+{
+	struct inode *ino = &s->inodes[i];
+	const off_t bs = (off_t)s->DATA_BLOCK_SIZE;
+	char *data;
+	int b, res;
+
+	if (size < 0)
+		return -EINVAL;
+	if (size / bs >= INT_MAX)
+		return -EFBIG;
+	/* buffered appends cut off whole need no blocks */
+	if (size <= (off_t)ino->pending_lblk * bs)
+		inode_drop_pending(s, ino);
+	res = inode_commit_pending(s, ino);
+	if (res != 0)
+		return res;
+	data = inode_inline_data(s, ino);
+	if (data && size > (off_t)s->inline_size) {
+		res = inode_promote(s, ino);
+		if (res != 0)
+			return res;
+		data = NULL;
+	}
+	/* the kept block's tail is zeroed below: a shared one is copied first */
+	if (!data && size <= ino->size && size % bs) {
+		res = myfs_blocks_unshare(s, ino, (int)(size / bs), 1);
+		if (res != 0)
+			return res;
+	}
+	/* logged first: the freed blocks may be reallocated right away */
+	journal_note(s, JOURNAL_TRUNCATE, i, size, 0, NULL);
+	if (data && size < ino->size) {
+		memset(data + size, 0, (size_t)(ino->size - size));
+	} else if (size <= ino->size) {
+		/* blocks reserved past the end go too */
+		myfs_blocks_truncate(s, ino, (int)((size + bs - 1) / bs));
+		/* the kept block's tail must read as zeros if the file grows again */
+		b = inode_block_at(ino, (int)(size / bs));
+		if (size % bs && b >= 0)
+			memset(s->data_blocks[b].data + size % bs, 0, (size_t)(bs - size % bs));
+	}
+	/* growing only moves the end: the new range is a hole */
+	ino->size = size;
+	inode_touch(ino, 0);
+	return 0;
+}
+
+int myfs_file_fallocate(struct myfs_state *s, int i, off_t offset, off_t len, int keep_size)
+{
+	struct inode *ino = &s->inodes[i];
+	const off_t bs = (off_t)s->DATA_BLOCK_SIZE;
+	off_t end;
+	int res;
+
+	if (offset < 0 || len <= 0 || len > INT64_MAX - offset)
+		return -EINVAL;
+	end = offset + len;
+	if (end / bs >= INT_MAX)
+		return -EFBIG;
+	res = inode_commit_pending(s, ino);
+	if (res != 0)
+		return res;
+	/* the inline area is there already; past it the file needs blocks */
+	if (!inode_inline_data(s, ino) || end > (off_t)s->inline_size) {
+		res = inode_promote(s, ino);
+		if (res == 0)
+			res = myfs_blocks_reserve(s, ino, (int)(offset / bs),
+						  (int)((end - 1) / bs - offset / bs + 1));
+		if (res != 0)
+			return res;
+	}
+	if (!keep_size && end > ino->size) {
+		ino->size = end;
+		journal_note(s, JOURNAL_SIZE, i, end, 0, NULL);
+		inode_touch(ino, 0);
+	}
+	return 0;
+}
+
+/* Copy len bytes of src at off_in to dst at off_out through a buffer,
+ * growing dst; one file's overlapping ranges are copied from the far end,
+ * as memmove would. Returns the bytes copied (all of them if backwards),
+ * or the error that stopped the first chunk. */
+static ssize_t clone_copy(struct myfs_state *s, struct inode *src, off_t off_in,
+			  struct inode *dst, off_t off_out, size_t len)
+{
+	const size_t chunk = 1 << 16;
+	int backward = src == dst && off_out > off_in;
+	size_t done = 0, n;
+	off_t skip;
+	ssize_t res = 0;
+	char *buf;
+
+	if (len == 0)
+		return 0;
+	buf = (char *)malloc(len < chunk ? len : chunk);
+	if (!buf)
+		return -ENOMEM;
+	while (done < len) {
+		n = len - done < chunk ? len - done : chunk;
+		skip = (off_t)(backward ? len - done - n : done);
+		/* appends buffered by the last chunk are not in the blocks yet */
+		res = inode_commit_pending(s, src);
+		if (res != 0)
+			break;
+		inode_read(s, src, src->size, buf, n, off_in + skip);
+		res = inode_write(s, dst, buf, n, off_out + skip);
+		if (res <= 0)
+			break;
+		if (off_out + skip + res > dst->size) {
+			dst->size = off_out + skip + res;
+			journal_note(s, JOURNAL_SIZE, dst->index, dst->size, 0, NULL);
+		}
+		done += (size_t)res;
+		if ((size_t)res < n)
+			break;
+	}
+	free(buf);
+	if (done == len || (done > 0 && !backward))
+		return (ssize_t)done;
+	return res < 0 ? res : -ENOSPC;
+}
+
+ssize_t myfs_file_clone(struct myfs_state *s, int src_i, off_t off_in, int dst_i, off_t off_out,
+			size_t len)
+{
+	struct inode *src = &s->inodes[src_i], *dst = &s->inodes[dst_i];
+	const off_t bs = (off_t)s->DATA_BLOCK_SIZE;
+	off_t head, tail, end;
+	ssize_t res;
+	int lblk, nblocks;
+
+	if (off_in < 0 || off_out < 0)
+		return -EINVAL;
+	res = inode_commit_pending(s, src);
+	if (res == 0)
+		res = inode_commit_pending(s, dst);
+	if (res != 0)
+		return res;
+	if (off_in >= src->size || len == 0)
+		return 0;
+	if ((off_t)len > src->size - off_in)
+		len = (size_t)(src->size - off_in);
+	if (off_out > INT64_MAX - (off_t)len || (off_out + (off_t)len - 1) / bs >= INT_MAX)
+		return -EFBIG;
+	end = off_out + (off_t)len;
+
+	/* blocks are shared only where both ranges sit alike in them, and not
+	 * between overlapping ranges of one file */
+	if (off_in % bs != off_out % bs || inode_inline_data(s, src) ||
+	    (src == dst && off_in < end && off_out < off_in + (off_t)len))
+		return clone_copy(s, src, off_in, dst, off_out, len);
+	head = (bs - off_in % bs) % bs;
+	if (head > (off_t)len)
+		head = (off_t)len;
+	nblocks = (int)(((off_t)len - head) / bs);
+	tail = ((off_t)len - head) % bs;
+	/* a last partial block can be shared too if it ends both files */
+	if (tail > 0 && off_in + (off_t)len == src->size && end >= dst->size) {
+		nblocks++;
+		tail = 0;
+	}
+	lblk = (int)((off_out + head) / bs);
+	res = inode_promote(s, dst);
+	if (res != 0)
+		return res;
+	/* only into a range with no blocks of its own (a hole or past the end) */
+	if (nblocks == 0 || inode_mapped_blocks(dst, lblk, nblocks) > 0)
+		return clone_copy(s, src, off_in, dst, off_out, len);
+
+	res = clone_copy(s, src, off_in, dst, off_out, (size_t)head);
+	if (res < head)
+		return res;
+	res = inode_commit_pending(s, dst);
+	if (res == 0)
+		res = myfs_blocks_share(s, src, (int)((off_in + head) / bs), dst, lblk, nblocks);
+	/* blocks with as many sharers as can be counted are copied instead */
+	if (res == -EMLINK) {
+		res = clone_copy(s, src, off_in + head, dst, off_out + head, len - (size_t)head);
+		return res < 0 ? (head > 0 ? (ssize_t)head : res) : (ssize_t)head + res;
+	}
+	if (res != 0)
+		return head > 0 ? (ssize_t)head : res;
+	if (end - tail > dst->size) {
+		dst->size = end - tail;
+		journal_note(s, JOURNAL_SIZE, dst_i, dst->size, 0, NULL);
+	}
+	res = clone_copy(s, src, off_in + (off_t)len - tail, dst, end - tail, (size_t)tail);
+	if (res < 0)
+		return (ssize_t)len - tail;
+	return (ssize_t)len - tail + res;
+}
+
+/* --- myfs_state create/destroy --- */
+struct myfs_state *myfs_state_create(FILE *log, const char *root, const char *image,
+                                     int num_inodes, int num_data_blocks, int data_block_size,
+                                     int inline_size)
+{
+	struct myfs_state *s;
+	int i;
+	char *rootpath;
+	pthread_rwlockattr_t attr;
+
+	s = (struct myfs_state *)calloc(1, sizeof(struct myfs_state));
+	if (!s)
+		return NULL;
+	/* a steady stream of reads and writes must not starve create/unlink */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&s->ns_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_mutex_init(&s->alloc_lock, NULL);
+	s->NUM_INODES = num_inodes;
+	s->NUM_DATA_BLOCKS = num_data_blocks;
+	s->DATA_BLOCK_SIZE = data_block_size;
+	s->inline_size = inline_size;
+	s->path_count = 0;
+	s->image_fd = -1;
+	s->block_arena_fd = -1;
+	s->journal.fd = -1;
+
+	if (inline_size < 0 || inline_size > data_block_size)
+		goto fail;
+	rootpath = realpath(root, NULL);
+	if (!rootpath)
+		goto fail;
+	s->rootdir = strdup(rootpath);
+	free(rootpath);
+	if (!s->rootdir)
+		goto fail;
+
+	/* one cache-line-aligned table; sizeof(struct inode) is a multiple
+	 * of the line, so every entry starts on one */
+	s->inodes = (struct inode *)aligned_alloc(CACHE_LINE, (size_t)num_inodes * sizeof(struct inode));
+	if (!s->inodes)
+		goto fail;
+	memset(s->inodes, 0, (size_t)num_inodes * sizeof(struct inode));
+	for (i = 0; i < num_inodes; i++) {
+		s->inodes[i].extents = s->inodes[i].inline_extents;
+		s->inodes[i].max_extents = INODE_INLINE_EXTENTS;
+		s->inodes[i].index = i;
+		pthread_rwlock_init(&s->inodes[i].lock, NULL);
+	}
+
+	s->path_to_inode = (struct path_inode *)malloc((size_t)num_inodes * sizeof(struct path_inode));
+	if (!s->path_to_inode)
+		goto fail;
+	s->root = dentry_new("", 0, -1);
+	if (!s->root)
+		goto fail;
+
+	/* bitmaps, inline area and block arena: mapped from the image, or fresh */
+	if (image) {
+		if (image_open(s, image) != 0)
+			goto fail;
+	} else {
+		s->block_arena_size = (size_t)num_data_blocks * (size_t)data_block_size;
+		s->block_arena = block_arena_map(s->block_arena_size, &s->block_arena_fd);
+		if (!s->block_arena && s->block_arena_size)
+			goto fail;
+		s->inline_data = (char *)calloc((size_t)num_inodes, (size_t)inline_size);
+		if (!s->inline_data && inline_size)
+			goto fail;
+		if (bitmap_init(&s->inode_bitmap, num_inodes) != 0 ||
+		    bitmap_init(&s->data_block_bitmap, num_data_blocks) != 0)
+			goto fail;
+	}
+	s->data_blocks = (struct data_block *)malloc((size_t)num_data_blocks * sizeof(struct data_block));
+	if (!s->data_blocks && num_data_blocks)
+		goto fail;
+	for (i = 0; i < num_data_blocks; i++)
+		s->data_blocks[i].data = s->block_arena + (size_t)i * (size_t)data_block_size;
+
+	s->logfile = log;
+	return s;
+
+fail:
+	/* the log stays open for the caller */
+	myfs_state_destroy(s);
+	return NULL;
+}
+
+/* Also releases a partially built state from myfs_state_create; an image
+ * is unmapped as it stands (image_sync first to keep recent changes) */
+void myfs_state_destroy(struct myfs_state *s)
+{
+	int i;
+	if (!s)
+		return;
+	if (s->logfile)
+		fclose(s->logfile);
+	free(s->rootdir);
+	free(s->data_blocks);
+	bitmap_free(&s->inode_bitmap);
+	bitmap_free(&s->data_block_bitmap);
+	free(s->block_refs);
+	journal_stop(s);
+	if (s->image_map || s->image_fd >= 0 || s->image_path) {
+		image_close(s);
+	} else {
+		if (s->block_arena)
+			munmap(s->block_arena, s->block_arena_size);
+		if (s->block_arena_fd >= 0)
+			close(s->block_arena_fd);
+		free(s->inline_data);
+	}
+	for (i = 0; s->inodes && i < s->NUM_INODES; i++) {
+		inode_clear_blocks(&s->inodes[i]);
+		free(s->inodes[i].pending);
+		pthread_rwlock_destroy(&s->inodes[i].lock);
+	}
+	free(s->inodes);
+	free(s->path_to_inode);
+	dentry_free(s->root);
+	myfs_changes_clear(s);
+	free(s->changes);
+	pthread_rwlock_destroy(&s->ns_lock);
+	pthread_mutex_destroy(&s->alloc_lock);
+	free(s);
+}
@@ -0,0 +1,478 @@
+/*
+  Multithreaded stress test for the myfs in-memory state.
+
+  Threads create, append to, overwrite, truncate, preallocate, clone, read
+  back and unlink a shared set of files through the same locking the FUSE
+  operations use, then the bitmaps, block maps, path_to_inode and the
+  directory tree are checked against each other. Files start out inline and are promoted to blocks as
+  they grow. They are spread over a few directories, which are removed
+  whenever they are found empty and come back with the next create, and
+  which are renamed into /hidden and back, files and all.
+
+  With delalloc_blocks, appends go through per-inode buffers of that many
+  blocks, and buffered bytes must read back like written ones. The last
+  argument picks the block allocation policy (--alloc).
+
+  usage: myfs_stress [threads [ops_per_thread [delalloc_blocks [lowest|next|best|groups]]]]
+*/
+
+#include "params.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define NUM_INODES 48
+#define NUM_DATA_BLOCKS 1024
+#define BLOCK_SIZE 64
+#define INLINE_SIZE 40		/* under a block: small files start inline */
+#define NUM_FILES 64		/* more names than inodes, so creates can fail */
+#define NUM_DIRS 4
+#define MAX_APPEND 300
+
+static struct myfs_state *s;
+static int ops_per_thread = 20000;
+static _Atomic int failed;
+/* whose bytes file f holds: its own, or those of the file it was cloned
+ * from (read and written under its inode's lock) */
+static int seed[NUM_FILES];
+
+/* The byte at offset off of file f, so stale or misplaced data shows up */
+static char pattern(int f, off_t off)
+{
+	return (char)(seed[f] * 131 + off * 7 + off / BLOCK_SIZE);
+}
+
+static void fail(const char *what, int f)
+{
+	fprintf(stderr, "myfs_stress: %s (file %d)\n", what, f);
+	atomic_store(&failed, 1);
+}
+
+static uint64_t rng_next(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void file_path(char *path, int f)
+{
+	snprintf(path, 32, "/d%d/f%d", f % NUM_DIRS, f);
+}
+
+static void do_create(int f)
+{
+	char path[32];
+
+	file_path(path, f);
+	myfs_op_begin(s, 1);
+	if (path_to_inode_lookup(s, path) < 0)
+		myfs_file_create(s, path, 0644);
+	myfs_op_end(s);
+}
+
+static void do_unlink(int f)
+{
+	char path[32];
+
+	file_path(path, f);
+	myfs_op_begin(s, 1);
+	myfs_file_unlink(s, path);
+	myfs_op_end(s);
+}
+
+static void do_rmdir(int d)
+{
+	char path[32];
+	int res;
+
+	snprintf(path, sizeof(path), "/d%d", d);
+	myfs_op_begin(s, 1);
+	res = myfs_dir_remove(s, path);
+	if (res != 0 && res != -ENOENT && res != -ENOTEMPTY)
+		fail("rmdir failed", d);
+	myfs_op_end(s);
+}
+
+/* Move directory d into /hidden (or back), which may replace an empty
+ * directory at the target */
+static void do_rename_dir(int d, int hide)
+{
+	char path[32], hidden[32];
+	int res;
+
+	snprintf(path, sizeof(path), "/d%d", d);
+	snprintf(hidden, sizeof(hidden), "/hidden/d%d", d);
+	myfs_op_begin(s, 1);
+	res = hide ? myfs_path_rename(s, path, hidden, 0) : myfs_path_rename(s, hidden, path, 0);
+	if (res != 0 && res != -ENOENT && res != -ENOTEMPTY)
+		fail("rename failed", d);
+	myfs_op_end(s);
+}
+
+/* Append len bytes, or (overwrite) write them at a random offset within
+ * the file, which may also extend it */
+static void do_write(int f, size_t len, int overwrite, uint64_t pick)
+{
+	char path[32], buf[MAX_APPEND];
+	struct inode *ino;
+	ssize_t res;
+	off_t off;
+	size_t k;
+	int i;
+
+	file_path(path, f);
+	myfs_op_begin(s, 0);
+	i = path_to_inode_lookup(s, path);
+	if (i >= 0) {
+		ino = &s->inodes[i];
+		pthread_rwlock_wrlock(&ino->lock);
+		off = overwrite ? (off_t)(pick % (uint64_t)(ino->size + 1)) : ino->size;
+		for (k = 0; k < len; k++)
+			buf[k] = pattern(f, off + (off_t)k);
+		res = inode_write(s, ino, buf, len, off);
+		if (res > 0 && off + res > ino->size)
+			ino->size = off + res;
+		else if (res < 0 && res != -ENOSPC)
+			fail("write failed", f);
+		pthread_rwlock_unlock(&ino->lock);
+	}
+	myfs_op_end(s);
+}
+
+/* Cut the file down to a random size no larger than it is */
+static void do_truncate(int f, uint64_t pick)
+{
+	char path[32];
+	struct inode *ino;
+	int i;
+
+	file_path(path, f);
+	myfs_op_begin(s, 0);
+	i = path_to_inode_lookup(s, path);
+	if (i >= 0) {
+		ino = &s->inodes[i];
+		pthread_rwlock_wrlock(&ino->lock);
+		if (myfs_file_truncate(s, i, (off_t)(pick % (uint64_t)(ino->size + 1))) < 0)
+			fail("truncate failed", f);
+		pthread_rwlock_unlock(&ino->lock);
+	}
+	myfs_op_end(s);
+}
+
+/* Reserve blocks over a random range from within the file to past its
+ * end, keeping the size: appends then land in zeroed blocks */
+static void do_fallocate(int f, uint64_t pick)
+{
+	char path[32];
+	struct inode *ino;
+	int i, res;
+
+	file_path(path, f);
+	myfs_op_begin(s, 0);
+	i = path_to_inode_lookup(s, path);
+	if (i >= 0) {
+		ino = &s->inodes[i];
+		pthread_rwlock_wrlock(&ino->lock);
+		res = myfs_file_fallocate(s, i, (off_t)(pick % (uint64_t)(ino->size + 1)),
+					  1 + (off_t)(pick >> 32) % (4 * BLOCK_SIZE), 1);
+		if (res < 0 && res != -ENOSPC)
+			fail("fallocate failed", f);
+		pthread_rwlock_unlock(&ino->lock);
+	}
+	myfs_op_end(s);
+}
+
+/* Make file g a clone of file f: emptied, then given all of f, mostly as
+ * shared blocks. A file cloned onto itself copies itself in place. */
+static void do_clone(int f, int g)
+{
+	char path[32];
+	struct inode *first, *second;
+	ssize_t res;
+	int i, j;
+
+	myfs_op_begin(s, 0);
+	file_path(path, f);
+	i = path_to_inode_lookup(s, path);
+	file_path(path, g);
+	j = path_to_inode_lookup(s, path);
+	if (i >= 0 && j >= 0) {
+		first = &s->inodes[i < j ? i : j];
+		second = &s->inodes[i < j ? j : i];
+		pthread_rwlock_wrlock(&first->lock);
+		if (second != first)
+			pthread_rwlock_wrlock(&second->lock);
+		if (i != j) {
+			if (myfs_file_truncate(s, j, 0) < 0)
+				fail("truncate failed", g);
+			seed[g] = seed[f];
+		}
+		res = myfs_file_clone(s, i, 0, j, 0, (size_t)s->inodes[i].size);
+		if (res < 0 && res != -ENOSPC)
+			fail("clone failed", g);
+		if (second != first)
+			pthread_rwlock_unlock(&second->lock);
+		pthread_rwlock_unlock(&first->lock);
+	}
+	myfs_op_end(s);
+}
+
+/* Read the whole file back; returns its size, or -1 if it does not exist */
+static off_t check_file(int f, int i, char *buf)
+{
+	struct inode *ino = &s->inodes[i];
+	off_t size, off;
+
+	if (inode_rdlock_committed(s, ino) != 0) {
+		fail("commit failed", f);
+		return -1;
+	}
+	size = ino->size;
+	if (inode_read(s, ino, size, buf, (size_t)size, 0) != (size_t)size)
+		fail("short read", f);
+	for (off = 0; off < size; off++) {
+		if (buf[off] != pattern(f, off)) {
+			fail("read back wrong data", f);
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&ino->lock);
+	return size;
+}
+
+static void do_read(int f, char *buf)
+{
+	char path[32];
+	int i;
+
+	file_path(path, f);
+	myfs_op_begin(s, 0);
+	i = path_to_inode_lookup(s, path);
+	if (i >= 0)
+		check_file(f, i, buf);
+	myfs_op_end(s);
+}
+
+static void *worker(void *arg)
+{
+	uint64_t rng = 88172645463325252ull + (uint64_t)(uintptr_t)arg * 0x9e3779b97f4a7c15ull;
+	char *buf = (char *)malloc((size_t)NUM_DATA_BLOCKS * BLOCK_SIZE);
+	int n, f, op;
+
+	for (n = 0; n < ops_per_thread && buf && !atomic_load(&failed); n++) {
+		f = (int)(rng_next(&rng) % NUM_FILES);
+		op = (int)(rng_next(&rng) % 100);
+		if (op < 15)
+			do_create(f);
+		else if (op < 27)
+			do_unlink(f);
+		else if (op < 55)
+			do_write(f, 1 + (size_t)(rng_next(&rng) % MAX_APPEND), 0, 0);
+		else if (op < 70)
+			do_write(f, 1 + (size_t)(rng_next(&rng) % MAX_APPEND), 1, rng_next(&rng));
+		else if (op < 75)
+			do_truncate(f, rng_next(&rng));
+		else if (op < 78)
+			do_rmdir(f % NUM_DIRS);
+		else if (op < 81)
+			do_rename_dir(f % NUM_DIRS, op & 1);
+		else if (op < 84)
+			do_fallocate(f, rng_next(&rng));
+		else if (op < 88)
+			do_clone(f, (int)(rng_next(&rng) % NUM_FILES));
+		else
+			do_read(f, buf);
+
+		/* nothing logs the changes here; don't let the list grow */
+		if ((n & 255) == 0) {
+			pthread_mutex_lock(&s->alloc_lock);
+			myfs_changes_clear(s);
+			pthread_mutex_unlock(&s->alloc_lock);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Check directory d and everything under it; returns the files in it */
+static int check_tree(const struct dentry *d)
+{
+	const struct dentry *c;
+	unsigned pos = 0;
+	int n = 0, files = 0;
+
+	if (d->inode >= 0)
+		return 1;
+	while ((c = dentry_next_child(d, &pos)) != NULL) {
+		if (c->parent != d)
+			fail("dentry has the wrong parent", c->inode);
+		n++;
+		files += check_tree(c);
+	}
+	if (n != d->nchildren)
+		fail("directory child count is off", n);
+	return files;
+}
+
+/* With every thread joined: bitmaps, block maps, paths and the tree must
+ * agree */
+static void check_consistency(void)
+{
+	static int maps[NUM_DATA_BLOCKS];
+	static int mapped[NUM_INODES];
+	char path[32], *buf;
+	const struct extent *e;
+	const struct inode *ino;
+	const char *data;
+	const struct dentry *d;
+	int i, j, b, nblocks, inodes_used = 0, free_blocks = 0, held = 0;
+	off_t want, off;
+
+	/* a block is held for every block buffered appends reach into */
+	for (i = 0; i < NUM_INODES; i++)
+		held += (s->inodes[i].pending_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (held != s->delalloc_held)
+		fail("held blocks do not match the buffered appends", held);
+	for (i = 0; i < NUM_INODES; i++)
+		if (inode_commit_pending(s, &s->inodes[i]) != 0)
+			fail("commit failed", i);
+	if (s->delalloc_held != 0)
+		fail("blocks still held after commit", s->delalloc_held);
+
+	for (b = 0; b < NUM_DATA_BLOCKS; b++)
+		maps[b] = 0;
+	for (i = 0; i < NUM_INODES; i++) {
+		ino = &s->inodes[i];
+		if (!bitmap_test(&s->inode_bitmap, i)) {
+			if (ino->num_blocks != 0)
+				fail("free inode still maps blocks", i);
+			continue;
+		}
+		inodes_used++;
+		nblocks = 0;
+		for (j = 0; j < ino->num_extents; j++) {
+			e = &ino->extents[j];
+			if (e->logical != nblocks)
+				fail("extents out of order", i);
+			nblocks += e->length;
+			for (b = e->start; b < e->start + e->length; b++) {
+				if (!bitmap_test(&s->data_block_bitmap, b))
+					fail("mapped block is free in the bitmap", i);
+				if (s->block_refs && s->block_refs[b] > 0 && !ino->shared)
+					fail("shared block mapped by an inode not marked shared", i);
+				maps[b]++;
+			}
+		}
+		want = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		data = inode_inline_data(s, ino);
+		if (data)
+			want = 0;
+		/* blocks past the end are reserved ones, and read as zeros */
+		if (nblocks != ino->num_blocks || nblocks < want)
+			fail("block count does not match the file size", i);
+		for (off = data ? nblocks * BLOCK_SIZE : ino->size; off < nblocks * BLOCK_SIZE; off++) {
+			if (s->data_blocks[inode_block_at(ino, (int)(off / BLOCK_SIZE))].data[off % BLOCK_SIZE] != 0) {
+				fail("block not zero past the end", i);
+				break;
+			}
+		}
+		for (off = ino->size; data && off < INLINE_SIZE; off++) {
+			if (data[off] != 0) {
+				fail("inline area not zero past the end", i);
+				break;
+			}
+		}
+	}
+	for (b = 0; b < NUM_DATA_BLOCKS; b++) {
+		if (!bitmap_test(&s->data_block_bitmap, b))
+			free_blocks++;
+		else if (maps[b] == 0)
+			fail("allocated block has no owner", b);
+		/* every mapping past the first is a counted sharer */
+		if (maps[b] > 1 + (s->block_refs ? s->block_refs[b] : 0))
+			fail("block mapped more often than it is shared", b);
+		if (maps[b] > 0 && maps[b] < 1 + (s->block_refs ? s->block_refs[b] : 0))
+			fail("block shared more often than it is mapped", b);
+	}
+	if (free_blocks != s->data_block_bitmap.nfree)
+		fail("data bitmap nfree is off", free_blocks);
+	if (NUM_INODES - inodes_used != s->inode_bitmap.nfree)
+		fail("inode bitmap nfree is off", inodes_used);
+
+	if (s->path_count != inodes_used)
+		fail("path count does not match allocated inodes", s->path_count);
+	for (i = 0; i < s->path_count; i++) {
+		j = s->path_to_inode[i].inode;
+		if (j < 0 || j >= NUM_INODES || !bitmap_test(&s->inode_bitmap, j) || mapped[j]++)
+			fail("path maps a free or shared inode", j);
+		d = s->path_to_inode[i].dentry;
+		if (d->inode != j || d->index != i)
+			fail("dentry disagrees with path_to_inode", j);
+		if (dentry_path(d, path, sizeof(path)) < 0 || path_to_inode_lookup(s, path) != j)
+			fail("path lookup disagrees with path_to_inode", j);
+	}
+	if (check_tree(s->root) != s->path_count)
+		fail("tree holds a different number of files", s->path_count);
+
+	buf = (char *)malloc((size_t)NUM_DATA_BLOCKS * BLOCK_SIZE);
+	for (j = 0; buf && j < NUM_FILES; j++) {
+		file_path(path, j);
+		i = path_to_inode_lookup(s, path);
+		if (i >= 0)
+			check_file(j, i, buf);
+	}
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	static const char *const policies[] = { "lowest", "next", "best", "groups" };
+	int nthreads = 4, delalloc = 0, policy = 0, t;
+
+	if (argc > 1)
+		nthreads = atoi(argv[1]);
+	if (argc > 2)
+		ops_per_thread = atoi(argv[2]);
+	if (argc > 3)
+		delalloc = atoi(argv[3]);
+	if (argc > 4)
+		while (policy < 4 && strcmp(argv[4], policies[policy]) != 0)
+			policy++;
+	if (nthreads < 1 || ops_per_thread < 0 || delalloc < 0 || policy == 4) {
+		fprintf(stderr, "usage: myfs_stress [threads [ops_per_thread [delalloc_blocks [lowest|next|best|groups]]]]\n");
+		return 2;
+	}
+
+	s = myfs_state_create(NULL, "/", NULL, NUM_INODES, NUM_DATA_BLOCKS, BLOCK_SIZE,
+			      INLINE_SIZE);
+	if (!s) {
+		fprintf(stderr, "myfs_state_create failed\n");
+		return 1;
+	}
+	myfs_dir_create(s, "/hidden");
+	for (t = 0; t < NUM_FILES; t++)
+		seed[t] = t;
+	s->delalloc_blocks = delalloc;
+	s->alloc_policy = (enum myfs_alloc_policy)policy;
+	/* MYFS_LOG_FULL would run every operation exclusively */
+	s->log_mode = MYFS_LOG_DELTA;
+
+	threads = (pthread_t *)calloc((size_t)nthreads, sizeof(pthread_t));
+	for (t = 0; threads && t < nthreads; t++)
+		pthread_create(&threads[t], NULL, worker, (void *)(uintptr_t)t);
+	for (t = 0; threads && t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+
+	check_consistency();
+	printf("myfs_stress: %d threads x %d ops: %s\n", nthreads, ops_per_thread,
+	       atomic_load(&failed) ? "FAILED" : "ok");
+	myfs_state_destroy(s);
+	return atomic_load(&failed) ? 1 : 0;
+}
@@ -8,30 +8,205 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
-/* DO NOT CHANGE THIS STRUCT */
+/* File blocks [logical, logical + length) live in data blocks [start, start + length) */
+struct extent {
+	int logical;
+	int start;
+	int length;
+};
+
+#define CACHE_LINE 64
+#define INODE_INLINE_EXTENTS 2
+
+/* An entry of the inode table. The first cache line holds what resolving
+ * a read or write needs, so a file of up to INODE_INLINE_EXTENTS extents
+ * is served from it alone; the lock sits in the second line, where taking
+ * it does not bounce the first between readers. The third holds what only
+ * getattr reads. */
 struct inode {
-	/* indices of data blocks associated with this inode */
-	int *blocks;
+	off_t size;		/* logical size of the file */
+	/* data blocks associated with this inode, sorted by logical: in
+	 * inline_extents until the file needs more than fit there */
+	struct extent *extents;
+	int num_extents;
+	int max_extents;
 	int num_blocks;
-};
+	int index;		/* in myfs_state.inodes */
+	struct extent inline_extents[INODE_INLINE_EXTENTS];
+
+	pthread_rwlock_t lock __attribute__((aligned(CACHE_LINE)));
+	off_t flushed;		/* bytes the backing file has (--mirror=writeback) */
+
+	/* set at create; writes and truncates move mtime and ctime, reads
+	 * leave atime alone (as noatime would) */
+	struct timespec atime __attribute__((aligned(CACHE_LINE)));
+	struct timespec mtime;
+	struct timespec ctime;
+	mode_t mode;		/* S_IFREG and the permission bits */
+
+	/* delayed allocation: the file's last pending_len bytes, from file
+	 * block pending_lblk on, wait in pending with no data blocks yet */
+	char *pending __attribute__((aligned(CACHE_LINE)));
+	int pending_len;
+	int pending_lblk;
+	/* a clone made the file share data blocks, so writes must check
+	 * block_refs and copy shared blocks first; cleared when it maps none */
+	int shared;
+} __attribute__((aligned(CACHE_LINE)));
 
 /* DO NOT CHANGE THIS STRUCT */
 struct data_block {
 	char *data;
 };
 
+/* Levels needed for 2^31 bits at 64 bits per word */
+#define BITMAP_MAX_LEVELS 6
+
+/* Bit-packed allocation bitmap (1 = allocated) with full-word summary levels */
+struct bitmap {
+	uint64_t *level[BITMAP_MAX_LEVELS];
+	int nwords[BITMAP_MAX_LEVELS];
+	int nlevels;
+	int nbits;
+	int nfree;		/* maintained by set/clear */
+	int external;		/* levels live in storage bitmap_init_at was given */
+};
+
+/* A name in the directory tree: a tracked file, or a directory (inode -1)
+ * whose children sit in its own open-addressing table. A path is only
+ * spelled out by walking parents (dentry_path), so moving a dentry renames
+ * everything under it. */
+struct dentry {
+	char *name;		/* last path component, owned; "" for the root */
+	uint32_t hash;		/* of name */
+	int inode;		/* the file's inode, or -1 for a directory */
+	int index;		/* files: their entry in path_to_inode */
+	struct dentry *parent;	/* NULL for the root */
+	struct dentry **children;	/* directories: child_mask + 1 slots */
+	unsigned child_mask;
+	int nchildren;
+	int untracked;		/* directories: may hold untracked files, which
+				 * only the backing directory lists */
+};
+
+/* A rename that myfs_path_rename_prepare has checked and allocated for */
+struct myfs_rename {
+	struct dentry *d;	/* what moves; NULL if there is nothing to do */
+	struct dentry *dir;	/* its new parent */
+	struct dentry *old;	/* what it replaces, or NULL */
+	char *name;		/* its new name, owned until commit */
+	size_t len;
+};
+
 /* One path-to-inode mapping entry (path_count <= NUM_INODES) */
 struct path_inode {
-	char path[PATH_MAX];
+	struct dentry *dentry;	/* the file's name in the tree */
 	int inode;
 };
 
-/* DO NOT CHANGE THIS STRUCT */
+/* What a full log ring does with another record */
+enum log_overflow {
+	LOG_OVERFLOW_BLOCK,	/* wait for the writer thread (nothing is lost) */
+	LOG_OVERFLOW_DROP,	/* drop it and report the count later */
+};
+
+/* Lock-free multi-producer log ring drained by one writer thread */
+struct log_ring {
+	char *buf;
+	size_t size;		/* power of two */
+	size_t mask;
+	_Atomic size_t reserve;	/* next byte handed to a producer */
+	_Atomic size_t tail;	/* next byte the writer consumes */
+	_Atomic unsigned long dropped;
+	_Atomic int producers_waiting;
+	_Atomic int writer_sleeping;
+	_Atomic int stopping;
+	enum log_overflow overflow;
+	int fd;
+	int running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t data;	/* records published */
+	pthread_cond_t space;	/* records consumed */
+};
+
+/* Redo records of metadata changes, replayed onto the last checkpoint */
+enum journal_type {
+	JOURNAL_CREATE = 1,	/* inode allocated for path, empty, with mode a */
+	JOURNAL_BLOCKS,		/* data blocks [a, a + b) mapped at file block lblk */
+	JOURNAL_SIZE,		/* inode's logical size set to a */
+	JOURNAL_UNLINK,		/* path and inode freed with all its blocks */
+	JOURNAL_TRUNCATE,	/* size set to a, blocks past it freed */
+	JOURNAL_RENAME,		/* path (file or directory) moved to the second path */
+};
+
+/* fsync checkpoints the whole image, rather than syncing one file, once
+ * the journal has grown by this many bytes since the last checkpoint */
+#define JOURNAL_CHECKPOINT_BYTES (64 << 20)
+
+/* Journal of a volume image (IMAGE.journal) */
+struct journal {
+	int fd;			/* -1 when not journaling */
+	int group;		/* 0: every commit does its own fdatasync */
+	uint64_t seq;		/* checkpoint the records follow */
+	pthread_mutex_t lock;
+	pthread_cond_t done;	/* durable_lsn advanced */
+	char *buf;		/* records logged but not yet written */
+	size_t len;
+	size_t cap;
+	uint64_t next_lsn;	/* bytes logged so far */
+	uint64_t durable_lsn;	/* bytes written and synced */
+	uint64_t checkpoint_lsn;	/* next_lsn at the last checkpoint */
+	int committing;		/* a thread is writing buf out */
+	unsigned long syncs;	/* fdatasync calls */
+};
+
+/* What log_fuse_context writes after each operation */
+enum myfs_log_mode {
+	MYFS_LOG_FULL,		/* the whole state (the graded format) */
+	MYFS_LOG_DELTA,		/* only the changes the operation made */
+};
+
+/* How the data of tracked files reaches their backing files under rootdir */
+enum myfs_mirror {
+	MYFS_MIRROR_SYNC,	/* each write is also pwritten to the backing file */
+	MYFS_MIRROR_MEMORY,	/* backing files are created but never written */
+	MYFS_MIRROR_WRITEBACK,	/* dirty data is written on release and fsync */
+};
+
+/* Which free data blocks the allocator hands out (--alloc) */
+enum myfs_alloc_policy {
+	MYFS_ALLOC_LOWEST,	/* the lowest free ones (the graded logs) */
+	MYFS_ALLOC_NEXT,	/* next fit: the first free at or after the last taken */
+	MYFS_ALLOC_BEST,	/* the shortest free run that fits the whole request */
+	MYFS_ALLOC_GROUPS,	/* next fit within the calling thread's group */
+};
+
+/* Allocation groups under MYFS_ALLOC_GROUPS: the data blocks are split into
+ * this many equal ranges, and each thread allocates from one of them */
+#define MYFS_ALLOC_NGROUPS 16
+
+/* One metadata change made by the current operation (MYFS_LOG_DELTA only) */
+struct myfs_change {
+	char kind;		/* 'I' inode, 'B' data blocks first..last, 'P' path,
+				 * 'R' path renamed to `to` */
+	char sign;		/* '+' allocated/added, '-' freed/removed */
+	int first, last;	/* inode or block range; the inode for 'P' */
+	char *path;		/* 'P' and 'R' only */
+	char *to;		/* 'R' only */
+};
+
 struct myfs_state {
 	int NUM_DATA_BLOCKS;
 	int NUM_INODES;
@@ -40,31 +215,425 @@ struct myfs_state {
 	FILE *logfile;
 	char *rootdir;
 
-	struct data_block **data_blocks;
-	struct inode **inodes;
+	/* data_blocks[i].data points into block_arena at i * DATA_BLOCK_SIZE */
+	struct data_block *data_blocks;
+	char *block_arena;
+	size_t block_arena_size;
+	/* the arena as a file, so reads can splice from it: block_arena
+	 * starts at block_arena_off in block_arena_fd (-1 if there is none) */
+	int block_arena_fd;
+	off_t block_arena_off;
+	struct inode *inodes;	/* the inode table, NUM_INODES entries */
+	/* inline data: inline_size bytes per inode, inode i's at
+	 * inline_data + i * inline_size; inline_size 0 turns it off */
+	char *inline_data;
+	int inline_size;
+	/* delayed allocation: appends gather in a buffer of delalloc_blocks
+	 * blocks per inode before data blocks are taken for them (0 turns it
+	 * off); delalloc_held blocks are kept free for the buffered bytes
+	 * (under alloc_lock) */
+	int delalloc_blocks;
+	int delalloc_held;
+	/* the allocation policy, and where next fit goes on from: overall and
+	 * in each group (under alloc_lock) */
+	enum myfs_alloc_policy alloc_policy;
+	int alloc_cursor;
+	int alloc_group_cursor[MYFS_ALLOC_NGROUPS];
+	int alloc_next_group;	/* the group the next new thread gets */
 
-	int *inode_bitmap;
-	int *data_block_bitmap;
+	/* volume image (--image), mapped whole; image_fd is -1 without one */
+	char *image_path;
+	int image_fd;
+	char *image_map;
+	size_t image_map_size;
+	struct journal journal;
 
+	struct bitmap inode_bitmap;
+	struct bitmap data_block_bitmap;
+	/* copy-on-write clones: how many file blocks map each data block
+	 * besides the first, NULL until one is first shared (under alloc_lock) */
+	uint16_t *block_refs;
+
+	/* every tracked file, in no order; lookups go through the tree */
 	struct path_inode *path_to_inode;
 	int path_count;
+	struct dentry *root;	/* the directory tree */
+
+	/*
+	 * Lock order: ns_lock, then an inode's lock, then alloc_lock.
+	 * ns_lock covers path_to_inode and the tree and is held across each
+	 * operation, exclusively by those that change names (and by everything
+	 * under MYFS_LOG_FULL, whose dump must see the state between
+	 * operations).
+	 * alloc_lock covers the bitmaps and the change list.
+	 */
+	pthread_rwlock_t ns_lock;
+	pthread_mutex_t alloc_lock;
+
+	enum myfs_log_mode log_mode;
+	enum myfs_mirror mirror;
+	struct log_ring log_ring;
+	struct myfs_change *changes;
+	int num_changes;
+	int max_changes;
 };
 
-/* Initialize a data block; size = DATA_BLOCK_SIZE */
-void data_block_init(struct data_block *b, int size);
+/* Allocate a bitmap of nbits, all free; returns 0 or -1 on failure */
+int bitmap_init(struct bitmap *b, int nbits);
+
+/* Words (all levels) of storage a bitmap of nbits needs */
+size_t bitmap_storage_words(int nbits);
+
+/* Lay a bitmap of nbits over caller-owned storage of bitmap_storage_words()
+ * words: all free if fresh, else keeping the bits already there */
+void bitmap_init_at(struct bitmap *b, int nbits, uint64_t *words, int fresh);
+
+/* Free the bitmap's words (not storage given to bitmap_init_at) */
+void bitmap_free(struct bitmap *b);
+
+/* Return 1 if bit i is allocated, 0 if free */
+int bitmap_test(const struct bitmap *b, int i);
+
+/* Mark bit i allocated / free */
+void bitmap_set(struct bitmap *b, int i);
+void bitmap_clear(struct bitmap *b, int i);
+
+/* Mark bits [first, first + n) free, a word at a time */
+void bitmap_clear_range(struct bitmap *b, int first, int n);
+
+/* Lowest free bit, or -1 if none */
+int bitmap_find_first_zero(const struct bitmap *b);
+
+/* Lowest free bit at or after from, or -1 if none */
+int bitmap_find_next_zero(const struct bitmap *b, int from);
+
+/* Lowest start at or after from of n consecutive free bits, or -1 if there
+ * is no such run */
+int bitmap_find_zero_run(const struct bitmap *b, int n, int from);
+
+/* Start of the shortest run of free bits at least n long (the lowest of
+ * those), or -1 if there is none */
+int bitmap_find_best_run(const struct bitmap *b, int n);
+
+/* Index of the extent holding file block lblk, or -1 (binary search) */
+int inode_extent_index(const struct inode *ino, int lblk);
+
+/* Index of the first extent ending after file block lblk (num_extents if
+ * none): the one holding lblk, or else the next one past a hole */
+int inode_extent_after(const struct inode *ino, int lblk);
+
+/* Data block holding file block lblk, or -1 */
+int inode_block_at(const struct inode *ino, int lblk);
+
+/* Make room for n extents, moving them out of the inline array once they
+ * don't fit; returns 0 or -1 if out of memory */
+int inode_reserve_extents(struct inode *ino, int n);
+
+/* Map data block `block` as the next file block, extending the last extent
+ * when it is contiguous; returns 0 or -1 if the extent array can't grow */
+int inode_append_block(struct inode *ino, int block);
+
+/* Map data block `block` at the unmapped file block lblk, merging it into
+ * the neighbouring extents when contiguous; returns 0 or -1 as above */
+int inode_map_block(struct inode *ino, int lblk, int block);
+
+/* Map data blocks [start, start + n) at the unmapped file blocks
+ * [lblk, lblk + n) the same way */
+int inode_map_extent(struct inode *ino, int lblk, int start, int n);
+
+/* Map data block `block` at the mapped file block lblk in place of the one
+ * there, splitting its extent if need be; returns 0 or -1 as above (with
+ * the old mapping kept) */
+int inode_remap_block(struct inode *ino, int lblk, int block);
+
+/* Number of file blocks in [lblk, lblk + n) that are mapped */
+int inode_mapped_blocks(const struct inode *ino, int lblk, int n);
+
+/* File block just past the last mapped one (0 for an empty map) */
+int inode_end_block(const struct inode *ino);
+
+/* Where ino keeps its bytes if its file is inline (the volume has an
+ * inline area, the file maps no blocks and fits the area), else NULL */
+char *inode_inline_data(const struct myfs_state *s, const struct inode *ino);
+
+/* Move an inline file's bytes to a newly mapped block 0 and zero its
+ * inline area; no-op unless the file is inline and not empty. Returns 0,
+ * -ENOSPC or -ENOMEM. */
+int inode_promote(struct myfs_state *s, struct inode *ino);
 
-/* Free a data block */
-void data_block_free(struct data_block *b);
+/* Set ino's mtime and ctime to now (atime too if all) */
+void inode_touch(struct inode *ino, int all);
 
-/* Create and initialize myfs_state; returns NULL on failure */
-struct myfs_state *myfs_state_create(FILE *log, const char *root, int num_inodes,
-                                      int num_data_blocks, int data_block_size);
+/* Drop every block mapping (the data blocks themselves are not freed) */
+void inode_clear_blocks(struct inode *ino);
+
+/* Drop the mappings of file blocks lblk and up, splitting an extent that
+ * straddles lblk (the data blocks themselves are not freed) */
+void inode_unmap_from(struct inode *ino, int lblk);
+
+/* Copy up to size bytes at offset out of an inode whose file is file_size
+ * bytes long, holes reading as zeros; returns the number of bytes copied */
+size_t inode_read(const struct myfs_state *s, const struct inode *ino, off_t file_size,
+		  char *buf, size_t size, off_t offset);
+
+/* Point up to max_iov iovecs at the file's bytes [offset, offset + size),
+ * clipped to file_size, one per extent or per run of zeros for a hole;
+ * returns the number filled */
+int inode_iovec(const struct myfs_state *s, const struct inode *ino, off_t file_size,
+		off_t offset, size_t size, struct iovec *iov, int max_iov);
+
+/* lseek SEEK_DATA / SEEK_HOLE from offset in a file_size byte file: the
+ * first byte at or after offset that is data (mapped) or in a hole, with
+ * the end of the file counting as a hole; -ENXIO at or past the end */
+off_t inode_seek(const struct myfs_state *s, const struct inode *ino, off_t file_size,
+		 off_t offset, int whence);
+
+/* Map every file block of [offset, offset + size), allocating data blocks
+ * for the unmapped ones and zeroing the parts of new blocks outside the
+ * range; inode_iovec then gives the range to copy into. An inline file
+ * the range still fits stays inline; one it outgrows is promoted first.
+ * Returns 0, or -ENOSPC with nothing allocated for the range (the file
+ * may have been promoted), -EFBIG or -ENOMEM */
+int inode_write_prepare(struct myfs_state *s, struct inode *ino, size_t size, off_t offset);
+
+/* Write size bytes at offset: mapped blocks are overwritten in place and
+ * data blocks are allocated only for the unmapped file blocks the write
+ * touches, so a gap it leaves past the end of the file stays a hole. With
+ * delalloc_blocks set, an append past the last block goes to the inode's
+ * buffer instead, and blocks are taken for it (as one run) when the buffer
+ * fills. Returns the bytes written (short only if the volume filled up
+ * partway through an append), -ENOSPC (nothing written), -EFBIG or -ENOMEM.
+ * The caller holds the inode's lock exclusively and updates the file size. */
+ssize_t inode_write(struct myfs_state *s, struct inode *ino, const char *buf,
+		    size_t size, off_t offset);
+
+/* Move ino's buffered appends into data blocks, one run where the volume
+ * has one; returns 0 or -ENOMEM. The caller holds the inode's lock
+ * exclusively. Anything reading the blocks or changing the block maps
+ * other than an append does this first. */
+int inode_commit_pending(struct myfs_state *s, struct inode *ino);
+
+/* Forget ino's buffered appends and free the buffer; the caller holds the
+ * inode's lock exclusively (or ns_lock, for an unlink) */
+void inode_drop_pending(struct myfs_state *s, struct inode *ino);
+
+/* Take ino's lock shared once its buffered appends are in data blocks;
+ * returns 0, or -ENOMEM without the lock */
+int inode_rdlock_committed(struct myfs_state *s, struct inode *ino);
+
+/* inode_write at file_size */
+ssize_t inode_append(struct myfs_state *s, struct inode *ino, off_t file_size,
+		     const char *buf, size_t size);
+
+/* Start a writer thread draining a ring of about `size` bytes into fd */
+int log_ring_start(struct log_ring *r, int fd, size_t size, enum log_overflow overflow);
+
+/* Queue len bytes for the writer; never blocks under LOG_OVERFLOW_DROP */
+void log_ring_write(struct log_ring *r, const char *data, size_t len);
+
+/* Wait until everything queued so far has been written */
+void log_ring_flush(struct log_ring *r);
+
+/* Write out what is queued and stop the writer thread */
+void log_ring_stop(struct log_ring *r);
+
+/* Create and initialize myfs_state, in memory or (image != NULL) over a
+ * volume image file that is created if empty, with inline_size bytes of
+ * inline data per inode (at most data_block_size); returns NULL on failure */
+struct myfs_state *myfs_state_create(FILE *log, const char *root, const char *image,
+                                     int num_inodes, int num_data_blocks, int data_block_size,
+                                     int inline_size);
+
+/* Map image as the volume of s (bitmaps and block arena), creating
+ * it if empty, and load its files' block maps and paths, recovering from
+ * the journal if it was not unmounted cleanly; call once the inodes and
+ * path tables exist. Returns 0 or -1 with a message on stderr. */
+int image_open(struct myfs_state *s, const char *image);
+
+/* Checkpoint: commit buffered appends, write the block maps, sizes and
+ * paths to the image, msync it and start an empty journal; unmount marks
+ * the image clean. The caller holds ns_lock exclusively. Returns 0 (also
+ * without an image) or -errno. */
+int image_sync(struct myfs_state *s, int unmount);
+
+/* Make the data of one file durable: msync only the pages of the mapping
+ * holding its blocks and inline bytes. Its metadata is durable once its
+ * journal records are. The caller holds the inode's lock. Returns 0 (also
+ * without an image) or -errno. */
+int image_sync_file(struct myfs_state *s, const struct inode *ino);
+
+/* Unmap and close the image, without syncing */
+void image_close(struct myfs_state *s);
+
+/* Start journaling metadata changes to the image's journal; group lets
+ * concurrent commits share one fdatasync. Returns 0 or -errno. */
+int journal_start(struct myfs_state *s, int group);
+
+/* Log a record (no-op without a journal); callers hold the locks that
+ * order it against other changes to the same inode or blocks */
+void journal_note(struct myfs_state *s, enum journal_type type, int inode,
+		  int64_t a, int64_t b, const char *path);
+
+/* Log that data blocks [start, start + n) now hold file blocks from lblk */
+void journal_note_blocks(struct myfs_state *s, int inode, int lblk, int start, int n);
+
+/* Log that path from was renamed to to */
+void journal_note_rename(struct myfs_state *s, const char *from, const char *to);
+
+/* Wait until this thread's records are durable; returns 0 or -errno */
+int journal_commit(struct myfs_state *s);
+
+/* Bytes logged since the last checkpoint (0 without a journal) */
+uint64_t journal_size(struct myfs_state *s);
+
+/* Apply the journal at path if it continues checkpoint seq; returns the
+ * number of records applied or -1 if it is unreadable */
+int journal_replay(struct myfs_state *s, const char *path, uint64_t seq);
+
+/* Drop every record and begin the journal for checkpoint seq (after
+ * image_sync); the caller holds ns_lock exclusively */
+int journal_reset(struct myfs_state *s, const char *path, uint64_t seq);
+
+/* Stop journaling and close the journal */
+void journal_stop(struct myfs_state *s);
 
 /* Free myfs_state and all owned resources */
 void myfs_state_destroy(struct myfs_state *s);
 
-/* Add (path, inode_index) to path_to_inode; use when creating a file */
-void path_to_inode_add(struct myfs_state *s, const char *path, int inode_index);
+/* Take / drop ns_lock around one operation; ns_change for create, unlink,
+ * mkdir, rmdir and rename. myfs_op_end then commits the journal records the
+ * operation logged and returns 0 or the commit's -errno. */
+void myfs_op_begin(struct myfs_state *s, int ns_change);
+int myfs_op_end(struct myfs_state *s);
+
+/* Mark inode i / data block b allocated (1) or free (0), noting the change;
+ * the caller holds alloc_lock */
+void myfs_inode_mark(struct myfs_state *s, int i, int allocated);
+void myfs_block_mark(struct myfs_state *s, int b, int allocated);
+
+/* Mark data blocks [b, b + n) free, noting the change; the caller holds
+ * alloc_lock */
+void myfs_blocks_mark_free(struct myfs_state *s, int b, int n);
+
+/* Forget the changes noted so far (after they have been logged) */
+void myfs_changes_clear(struct myfs_state *s);
+
+/* Map free data blocks, chosen by s->alloc_policy, at every unmapped file
+ * block of ino in [lblk, lblk + n); returns 0, or -ENOSPC with nothing
+ * allocated (blocks held for buffered appends are not free), or -ENOMEM */
+int myfs_blocks_alloc(struct myfs_state *s, struct inode *ino, int lblk, int n);
+
+/* Like myfs_blocks_alloc, but take the blocks as one run where the policy
+ * finds one long enough (else single blocks), and zero them */
+int myfs_blocks_reserve(struct myfs_state *s, struct inode *ino, int lblk, int n);
+
+/* Like myfs_blocks_alloc, taking one run where possible, for the blocks
+ * held for n blocks of buffered appends (myfs_blocks_hold) */
+int myfs_blocks_commit(struct myfs_state *s, struct inode *ino, int lblk, int n);
+
+/* Keep n more data blocks free for buffered appends, or give back -n of
+ * them; returns 0, or -ENOSPC if fewer than n are left */
+int myfs_blocks_hold(struct myfs_state *s, int n);
+
+/* Free the data blocks of ino mapped at file block lblk and up, one bitmap
+ * range per extent, and drop those mappings. Freed blocks keep their
+ * bytes; whoever maps them next zeroes what it does not write. */
+void myfs_blocks_truncate(struct myfs_state *s, struct inode *ino, int lblk);
+
+/* Free every data block of ino and drop its mappings */
+void myfs_blocks_free(struct myfs_state *s, struct inode *ino);
+
+/* Drop one mapping of each of data blocks [b, b + n): shared ones lose a
+ * sharer, the rest are freed, noting the change if note; the caller holds
+ * alloc_lock (or is replaying the journal) */
+void myfs_blocks_put(struct myfs_state *s, int b, int n, int note);
+
+/* Add a sharer to mapped data block b; returns 0, -EMLINK if it has as
+ * many as block_refs counts, or -ENOMEM. The caller holds alloc_lock (or
+ * is replaying the journal). */
+int myfs_block_ref(struct myfs_state *s, int b);
+
+/* Map at file blocks [dst_lblk, dst_lblk + n) of dst, which maps none of
+ * them, the data blocks src maps at [lblk, lblk + n), sharing them (holes
+ * stay holes), and mark both inodes shared. Returns 0, -EMLINK or -ENOMEM
+ * with nothing mapped. The caller holds both inodes' locks. */
+int myfs_blocks_share(struct myfs_state *s, struct inode *src, int lblk, struct inode *dst,
+		      int dst_lblk, int n);
+
+/* Give ino a copy of its own of every shared data block it maps in
+ * [lblk, lblk + n), before it writes there; returns 0, -ENOSPC or -ENOMEM */
+int myfs_blocks_unshare(struct myfs_state *s, struct inode *ino, int lblk, int n);
+
+/* Whether the free data blocks (less those held for buffered appends)
+ * cover what writing ino's [lblk, lblk + n) takes: one per unmapped file
+ * block and one per shared block to unshare; returns 0 or -ENOSPC */
+int myfs_blocks_room(struct myfs_state *s, const struct inode *ino, int lblk, int n);
+
+/* Rebuild block_refs and the inodes' shared flags from the block maps (at
+ * mount); returns 0, or -1 if a block has too many sharers or memory runs
+ * out */
+int myfs_blocks_count_refs(struct myfs_state *s);
+
+/* Give path the lowest free inode, with no data blocks, as a regular file
+ * with mode's permission bits (missing parent directories are added to
+ * the tree); returns the inode, -ENOSPC, -EISDIR, -ENOTDIR or -ENOMEM.
+ * The caller holds ns_lock exclusively. */
+int myfs_file_create(struct myfs_state *s, const char *path, mode_t mode);
+
+/* Free path's inode and blocks and drop the path; returns the inode or
+ * -ENOENT. The caller holds ns_lock exclusively. */
+int myfs_file_unlink(struct myfs_state *s, const char *path);
+
+/* Add directory path to the tree; returns 0, -EEXIST, -ENOTDIR or
+ * -ENOMEM. The caller holds ns_lock exclusively. */
+int myfs_dir_create(struct myfs_state *s, const char *path);
+
+/* Drop empty directory path from the tree; returns 0, -ENOENT, -ENOTDIR,
+ * -ENOTEMPTY or -EBUSY for the root. The caller holds ns_lock exclusively. */
+int myfs_dir_remove(struct myfs_state *s, const char *path);
+
+/* Move from to to, replacing a file or empty directory already there
+ * unless noreplace. Only from's dentry moves, so renaming a directory
+ * takes the same time whatever is under it. Returns 0, -ENOENT, -ENOTDIR,
+ * -EISDIR, -ENOTEMPTY, -EEXIST, -EINVAL (to inside from), -EBUSY (the
+ * root) or -ENOMEM. The caller holds ns_lock exclusively. */
+int myfs_path_rename(struct myfs_state *s, const char *from, const char *to, int noreplace);
+
+/* myfs_path_rename in two steps, for a caller that must change rootdir in
+ * between: prepare makes every check and allocation, returning the same
+ * errors, and commit then cannot fail. A prepared rename that is not
+ * committed is cancelled. The caller holds ns_lock exclusively throughout. */
+int myfs_path_rename_prepare(struct myfs_state *s, const char *from, const char *to,
+			     int noreplace, struct myfs_rename *r);
+void myfs_path_rename_commit(struct myfs_state *s, const char *from, const char *to,
+			     struct myfs_rename *r);
+void myfs_path_rename_cancel(struct myfs_rename *r);
+
+/* Set inode i's size: shrinking (or keeping it) frees the blocks past the
+ * new end and zeroes the rest of the last one, growing leaves a hole (promoting an
+ * inline file that outgrows its area). Returns 0, -EINVAL, -EFBIG or
+ * -ENOSPC. The caller holds the inode's lock exclusively. */
+int myfs_file_truncate(struct myfs_state *s, int i, off_t size);
+
+/* Map zeroed blocks, as one run where possible, at every unmapped file
+ * block of inode i in [offset, offset + len), and grow the size to
+ * offset + len unless keep_size. Writes into the range then allocate
+ * nothing. Returns 0, -EINVAL, -EFBIG, -ENOSPC or -ENOMEM. The caller
+ * holds the inode's lock exclusively. */
+int myfs_file_fallocate(struct myfs_state *s, int i, off_t offset, off_t len, int keep_size);
+
+/* Copy up to len bytes of inode src's file at off_in to inode dst's at
+ * off_out (copy_file_range), growing dst to fit. Where both offsets sit
+ * at the same place in a block, whole blocks (and a last block at the
+ * end of both files) are shared rather than copied. Returns the bytes
+ * copied, or -EINVAL, -EFBIG, -ENOSPC, -EMLINK or -ENOMEM if none were.
+ * The caller holds both inodes' locks exclusively. */
+ssize_t myfs_file_clone(struct myfs_state *s, int src, off_t off_in, int dst, off_t off_out,
+			size_t len);
+
+/* Add (path, inode_index) to path_to_inode; use when creating a file.
+ * Returns 0, -ENOSPC if every inode already has a path, or -ENOMEM */
+int path_to_inode_add(struct myfs_state *s, const char *path, int inode_index);
 
 /* Remove entry for path; use when unlinking a file */
 void path_to_inode_remove(struct myfs_state *s, const char *path);
@@ -72,6 +641,29 @@ void path_to_inode_remove(struct myfs_state *s, const char *path);
 /* Lookup inode index for path; returns -1 if not found */
 int path_to_inode_lookup(struct myfs_state *s, const char *path);
 
+/* The dentry for path, or NULL */
+struct dentry *dentry_lookup(struct myfs_state *s, const char *path);
+
+/* Add path to the tree as a file with inode, or as a directory if inode
+ * is -1, adding any missing parent directories; an existing file gets the
+ * new inode. Returns the dentry, or NULL if out of memory, if a parent is
+ * a file or if path already names the other kind. */
+struct dentry *dentry_add(struct myfs_state *s, const char *path, int inode);
+
+/* Write d's path into buf ("/" for the root); returns its length, or -1
+ * if it needs more than size bytes */
+int dentry_path(const struct dentry *d, char *buf, size_t size);
+
+/* 0 if dentry_add could add path as a file, else -EISDIR or -ENOTDIR */
+int dentry_check_file(struct myfs_state *s, const char *path);
+
+/* Unlink d from its parent and free it; d has no children */
+void dentry_remove(struct dentry *d);
+
+/* The child of directory dir in table slot *pos or the first one after
+ * it, advancing *pos past it; NULL once the table is exhausted */
+struct dentry *dentry_next_child(const struct dentry *dir, unsigned *pos);
+
 #define MYFS_DATA ((struct myfs_state *) fuse_get_context()->private_data)
 
 #endif